@@ -0,0 +1,110 @@
+/*
+ * File: CFCSSRuntime.h
+ *
+ *      Interface of the CFCSS runtime library in lib/Runtime, which handles signature faults in
+ *      programs instrumented with -cfcss-fault-hook=cfcss_signature_fault and writes the counts
+ *      of programs instrumented with -cfcss-profile-checks.
+ */
+#ifndef CFCSS_RUNTIME_H
+#define CFCSS_RUNTIME_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A signature check, emitted by the instrumentation as a writable global. The layout has to match
+ * the one in InstrumentBasicBlocks.
+ */
+struct cfcss_fault_site {
+  /* The instrumented function. */
+  const char *function;
+  /* Numbers the checks of a module. */
+  uint32_t id;
+  /* Faults at this check so far, maintained by the runtime. */
+  uint64_t count;
+  /* Next site that faulted at least once, maintained by the runtime. */
+  struct cfcss_fault_site *next;
+};
+
+enum cfcss_fault_policy {
+  /* Report the fault and abort(), the default. */
+  CFCSS_FAULT_ABORT,
+  /* Report the first fault at each check and carry on with the expected signature. */
+  CFCSS_FAULT_CONTINUE
+};
+
+/*
+ * The fault hook, called upon a signature mismatch with the expected signature and the observed
+ * contents of GSR. Under -cfcss-deferred-checks, observed is the accumulated error instead, i.e.
+ * the bits in which signature updates since the last check differed from their signatures.
+ * Returns only under CFCSS_FAULT_CONTINUE.
+ */
+void cfcss_signature_fault(struct cfcss_fault_site *site, uint64_t expected, uint64_t observed);
+
+/*
+ * Override the policy, which is otherwise taken from CFCSS_FAULT_POLICY ("abort" or "continue")
+ * at startup.
+ */
+void cfcss_set_fault_policy(enum cfcss_fault_policy policy);
+
+/*
+ * Number of faults so far, across all checks.
+ */
+uint64_t cfcss_fault_count(void);
+
+/*
+ * Call the given function for every check that faulted so far, most recently first faulted first.
+ */
+void cfcss_for_each_fault_site(void (*callback)(const struct cfcss_fault_site *site, void *data),
+    void *data);
+
+/*
+ * What a counter of -cfcss-profile-checks counts.
+ */
+enum cfcss_profile_kind {
+  /* The signature update of a basic block, or the entry of a gateway. */
+  CFCSS_PROFILE_UPDATE,
+  /* The runtime adjusting signature stored to D before leaving a basic block. */
+  CFCSS_PROFILE_ADJUST
+};
+
+/*
+ * Describes one counter, emitted by the instrumentation alongside the counter array.
+ */
+struct cfcss_profile_entry {
+  const char *function;
+  /* Hash of the signatures of the function, which tells stale profiles apart. */
+  uint64_t fingerprint;
+  uint32_t kind;
+  uint64_t signature;
+};
+
+/*
+ * The counters of an instrumented module, registered from a constructor. The layout has to match
+ * the one in InstrumentBasicBlocks.
+ */
+struct cfcss_profile {
+  const char *module;
+  uint32_t num_counters;
+  uint64_t *counters;
+  const struct cfcss_profile_entry *entries;
+  /* Next registered module, maintained by the runtime. */
+  struct cfcss_profile *next;
+};
+
+void cfcss_register_profile(struct cfcss_profile *profile);
+
+/*
+ * Append the counts of all registered modules to the given file, in the format read by
+ * -cfcss-check-profile. This happens at exit anyway, to $CFCSS_PROFILE or cfcss.profile.
+ */
+int cfcss_write_profile(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
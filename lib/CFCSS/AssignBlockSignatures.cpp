@@ -2,15 +2,34 @@
 
 #include "AssignBlockSignatures.h"
 
+#include "SignatureRegions.h"
+
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Metadata.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/CFG.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
 
 using namespace llvm;
 
@@ -18,31 +37,102 @@ static const char *debugPrefix = "AssignBlockSignatures: ";
 
 namespace cfcss {
 
-  llvm::cl::opt<bool> Signatures32("cfcss-signatures-32bit",
-      llvm::cl::desc("Use 32-bit signatures for CFCSS. The default is to use 64-bit signatures."));
+  enum SignatureWidthOption {
+    SignatureWidthAuto = 0,
+    SignatureWidth8 = 8,
+    SignatureWidth16 = 16,
+    SignatureWidth32 = 32,
+    SignatureWidth64 = 64
+  };
+
+  static llvm::cl::opt<SignatureWidthOption> SignatureWidth("cfcss-signature-width",
+      llvm::cl::desc("Width of signatures in bits. The default is to use 64-bit signatures."),
+      llvm::cl::values(
+          clEnumValN(SignatureWidthAuto, "auto",
+              "Narrowest width that fits the number of basic blocks in the module"),
+          clEnumValN(SignatureWidth8, "8", "8-bit signatures"),
+          clEnumValN(SignatureWidth16, "16", "16-bit signatures"),
+          clEnumValN(SignatureWidth32, "32", "32-bit signatures"),
+          clEnumValN(SignatureWidth64, "64", "64-bit signatures"),
+          clEnumValEnd),
+      llvm::cl::init(SignatureWidth64));
+
+  static llvm::cl::opt<bool> Signatures32("cfcss-signatures-32bit",
+      llvm::cl::desc("Use 32-bit signatures for CFCSS, same as -cfcss-signature-width=32."));
+
+  static llvm::cl::opt<unsigned long long> SignatureBase("cfcss-signature-base",
+      llvm::cl::desc("First signature to hand out in this module. Instrumenting translation units "
+          "separately with disjoint ranges keeps their blocks apart. The default is 0."),
+      llvm::cl::init(0));
+
+  static llvm::cl::opt<bool> SaltSignatures("cfcss-salt-signatures",
+      llvm::cl::desc("Derive the first signature from the strong external definitions of the "
+          "module instead, which gives separately instrumented translation units disjoint ranges "
+          "without coordination, with high probability, and doesn't depend on the build "
+          "directory. Requires 64-bit signatures. Use -cfcss-signature-index to rule out "
+          "collisions."));
+
+  static llvm::cl::opt<std::string> SignatureIndex("cfcss-signature-index",
+      llvm::cl::desc("Record the range of signatures handed out in this module in the given file, "
+          "shared by all translation units of a program, and fail if it overlaps the range of "
+          "any other module recorded there. Remove the file along with the build."),
+      llvm::cl::value_desc("file"));
+
+  llvm::cl::opt<bool> ProfileGuided("cfcss-profile-guided",
+      llvm::cl::desc("Use branch weights and block frequencies to pick the most frequently "
+          "executed edges and call sites as authoritative. The default is to pick the first one "
+          "found."));
+
+  static llvm::cl::opt<bool> ShareSiblingSignatures("cfcss-share-sibling-signatures",
+      llvm::cl::desc("Give predecessors of fanin nodes that have the same predecessors and "
+          "successors the same signature, so that they need no runtime adjusting "
+          "signature."));
+
+  static llvm::cl::opt<bool> NameBlocks("cfcss-name-blocks",
+      llvm::cl::desc("Prefix the name of every basic block with its signature, for reading the "
+          "IR. Signatures are always kept in !cfcss.sig metadata."));
+
+  STATISTIC(NumSharedSignatures, "Number of basic blocks sharing the signature of a sibling");
+  STATISTIC(NumDStoresEliminated, "Number of runtime adjusting signature stores eliminated");
 
   AssignBlockSignatures::AssignBlockSignatures() : ModulePass(ID),
+      BFI(NULL),
+      BPI(NULL),
+      signatureType(NULL),
+      signatureKind(0),
       blockSignatures(),
       primaryPredecessors(),
       primarySiblings(),
       faninBlocks(),
       faninSuccessors(),
-      nextID(0) {
+      nextID(0),
+      moduleHash(0) {
   }
 
 
   void AssignBlockSignatures::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<SignatureRegions>();
+
+    if (ProfileGuided) {
+      AU.addRequired<BlockFrequencyInfo>();
+      AU.addRequired<BranchProbabilityInfo>();
+    }
+
     AU.setPreservesAll();
   }
 
 
   bool AssignBlockSignatures::runOnModule(Module &M) {
-    IntegerType *intType = NULL;
-    if (Signatures32.getValue()) {
-      intType = Type::getInt32Ty(getGlobalContext());
-    } else {
-      intType = Type::getInt64Ty(getGlobalContext());
-    }
+    moduleHash = hashName(getStableModuleName(M));
+
+    uint64_t firstID = chooseSignatureBase(M);
+    nextID = firstID;
+    signatureType = chooseSignatureType(M, firstID);
+    IntegerType *intType = signatureType;
+
+    signatureKind = M.getContext().getMDKindID("cfcss.sig");
+
+    SignatureRegions &SR = getAnalysis<SignatureRegions>();
 
     for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
       if (fi->isDeclaration()) {
@@ -53,9 +143,41 @@ namespace cfcss {
 
       DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "] ... ");
 
-      for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi, ++nextID) {
-        blockSignatures.insert(BlockToSignatureEntry(bi, Signature::get(intType, nextID)));
-        bi->setName(Twine("0x") + Twine::utohexstr(nextID) + Twine(": ") + bi->getName());
+      if (ProfileGuided) {
+        BFI = &getAnalysis<BlockFrequencyInfo>(*fi);
+        BPI = &getAnalysis<BranchProbabilityInfo>(*fi);
+      }
+
+      BlockToBlockMap equivalentSiblings;
+      if (ShareSiblingSignatures) {
+        findEquivalentSiblings(fi, SR, equivalentSiblings);
+      }
+
+      // Region heads need not precede the rest of their region in layout order, so they get their
+      // signatures first.
+      for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
+        if (!SR.isRegionHead(bi)) {
+          continue;
+        }
+
+        if (BasicBlock *sibling = equivalentSiblings.lookup(bi)) {
+          Signature *signature = blockSignatures.lookup(sibling);
+          blockSignatures.insert(BlockToSignatureEntry(bi, signature));
+
+          ++NumSharedSignatures;
+        } else {
+          blockSignatures.insert(BlockToSignatureEntry(bi, Signature::get(intType, nextID)));
+          ++nextID;
+        }
+      }
+
+      SmallVector<BasicBlock*, 32> functionFaninBlocks;
+
+      for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
+        if (!SR.isRegionHead(bi)) {
+          Signature *signature = blockSignatures.lookup(SR.getRegionHead(bi));
+          blockSignatures.insert(BlockToSignatureEntry(bi, signature));
+        }
 
         for (succ_iterator si = succ_begin(bi), se = succ_end(bi); si != se; ++si) {
           BasicBlock *succ = *si;
@@ -63,9 +185,21 @@ namespace cfcss {
             // Successor is a fanin node.
             faninBlocks.insert(succ);
             if (!primaryPredecessors.count(succ)) {
-              primaryPredecessors.insert(BlockToBlockEntry(succ, bi));
+              functionFaninBlocks.push_back(succ);
+
+              BasicBlock *authoritativePredecessor = bi;
+
+              // Fanin nodes sharing a predecessor share all predecessors once aliasing has been
+              // removed, so they have to agree on the authoritative sibling as well.
+              if (BasicBlock *sibling = primarySiblings.lookup(bi)) {
+                authoritativePredecessor = sibling;
+              } else if (ProfileGuided) {
+                authoritativePredecessor = getHottestPredecessor(succ);
+              }
+
+              primaryPredecessors.insert(BlockToBlockEntry(succ, authoritativePredecessor));
               for (pred_iterator pi = pred_begin(succ), pe = pred_end(succ); pi != pe; ++pi) {
-                primarySiblings.insert(BlockToBlockEntry(*pi, bi));
+                primarySiblings.insert(BlockToBlockEntry(*pi, authoritativePredecessor));
                 faninSuccessors.insert(*pi);
               }
             }
@@ -75,6 +209,12 @@ namespace cfcss {
         }
       }
 
+      if (ShareSiblingSignatures) {
+        eliminateRuntimeAdjustment(functionFaninBlocks);
+      }
+
+      annotateBlocks(fi);
+
       DEBUG(
         errs().changeColor(raw_ostream::GREEN);
         errs() << "done\n";
@@ -82,7 +222,319 @@ namespace cfcss {
       );
     }
 
-    return false;
+    NamedMDNode *ranges = M.getOrInsertNamedMetadata("cfcss.signatures");
+    Value *range[] = {
+      ConstantInt::get(Type::getInt32Ty(M.getContext()), intType->getBitWidth()),
+      ConstantInt::get(Type::getInt64Ty(M.getContext()), firstID),
+      ConstantInt::get(Type::getInt64Ty(M.getContext()), nextID)
+    };
+    ranges->addOperand(MDNode::get(M.getContext(), range));
+
+    if (!SignatureIndex.empty()) {
+      recordSignatureRange(M, firstID, nextID);
+    }
+
+    return true;
+  }
+
+
+  void AssignBlockSignatures::annotateBlocks(Function *F) {
+    LLVMContext &context = F->getContext();
+    Type *boolType = Type::getInt1Ty(context);
+
+    for (Function::iterator bi = F->begin(), be = F->end(); bi != be; ++bi) {
+      Signature *signature = blockSignatures.lookup(bi);
+      BasicBlock *authoritativePredecessor = primaryPredecessors.lookup(bi);
+      BasicBlock *authoritativeSibling = primarySiblings.lookup(bi);
+
+      Value *operands[] = {
+        signature,
+        authoritativePredecessor ? blockSignatures.lookup(authoritativePredecessor) : NULL,
+        authoritativeSibling ? blockSignatures.lookup(authoritativeSibling) : NULL,
+        ConstantInt::get(boolType, faninBlocks.count(bi)),
+        ConstantInt::get(boolType, faninSuccessors.count(bi))
+      };
+
+      bi->getTerminator()->setMetadata(signatureKind, MDNode::get(context, operands));
+
+      if (NameBlocks) {
+        bi->setName(Twine("0x") + Twine::utohexstr(signature->getZExtValue()) + Twine(": ")
+            + bi->getName());
+      }
+    }
+  }
+
+
+  void AssignBlockSignatures::findEquivalentSiblings(Function *F, SignatureRegions &SR,
+      BlockToBlockMap &equivalentSiblings) {
+
+    // Two blocks with the same predecessors and successors can't be told apart by any control flow
+    // transfer that CFCSS is able to detect in the first place, so they may as well share their
+    // signature. Fanin nodes whose predecessors all share a signature don't need to be adjusted.
+    typedef std::vector<BasicBlock*> BlockVector;
+    typedef std::pair<BlockVector, BlockVector> Neighbourhood;
+
+    std::map<Neighbourhood, BasicBlock*> representatives;
+
+    for (Function::iterator bi = F->begin(), be = F->end(); bi != be; ++bi) {
+      // Members of a region carry the signature of their head, and blocks without predecessors
+      // are either the entry block or unreachable.
+      if (!SR.isRegionHead(bi) || pred_begin(bi) == pred_end(bi)) {
+        continue;
+      }
+
+      bool hasFaninSuccessor = false;
+      for (succ_iterator si = succ_begin(bi), se = succ_end(bi); si != se; ++si) {
+        if (++pred_begin(*si) != pred_end(*si)) {
+          hasFaninSuccessor = true;
+          break;
+        }
+      }
+
+      if (!hasFaninSuccessor) {
+        continue;
+      }
+
+      Neighbourhood neighbourhood;
+      neighbourhood.first.assign(pred_begin(bi), pred_end(bi));
+      neighbourhood.second.assign(succ_begin(bi), succ_end(bi));
+
+      for (unsigned int idx = 0; idx < 2; ++idx) {
+        BlockVector &blocks = idx ? neighbourhood.second : neighbourhood.first;
+        std::sort(blocks.begin(), blocks.end());
+        blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+      }
+
+      std::pair<std::map<Neighbourhood, BasicBlock*>::iterator, bool> representative =
+          representatives.insert(std::make_pair(neighbourhood, &*bi));
+
+      if (!representative.second) {
+        DEBUG(errs() << "\n" << debugPrefix << "[" << bi->getName() << "] shares the signature of ["
+            << representative.first->second->getName() << "]. ");
+
+        equivalentSiblings.insert(BlockToBlockEntry(bi, representative.first->second));
+      }
+    }
+  }
+
+
+  void AssignBlockSignatures::eliminateRuntimeAdjustment(
+      SmallVectorImpl<BasicBlock*> &functionFaninBlocks) {
+
+    for (SmallVectorImpl<BasicBlock*>::iterator fi = functionFaninBlocks.begin(),
+        fe = functionFaninBlocks.end(); fi != fe; ++fi) {
+
+      BasicBlock *BB = *fi;
+      Signature *signature = blockSignatures.lookup(primaryPredecessors.lookup(BB));
+
+      bool needsAdjustment = false;
+      for (pred_iterator pi = pred_begin(BB), pe = pred_end(BB); pi != pe; ++pi) {
+        if (blockSignatures.lookup(*pi) != signature) {
+          needsAdjustment = true;
+          break;
+        }
+      }
+
+      if (needsAdjustment) {
+        continue;
+      }
+
+      // D is statically zero on every incoming edge. Predecessors sharing other fanin successors
+      // share all their predecessors as well, so those don't need D either.
+      faninBlocks.erase(BB);
+      for (pred_iterator pi = pred_begin(BB), pe = pred_end(BB); pi != pe; ++pi) {
+        if (faninSuccessors.erase(*pi)) {
+          ++NumDStoresEliminated;
+        }
+      }
+    }
+  }
+
+
+  BasicBlock* AssignBlockSignatures::getHottestPredecessor(BasicBlock * const BB) {
+    BasicBlock *hottest = NULL;
+    BlockFrequency hottestFrequency;
+
+    for (pred_iterator pi = pred_begin(BB), pe = pred_end(BB); pi != pe; ++pi) {
+      BlockFrequency frequency = BFI->getBlockFreq(*pi) * BPI->getEdgeProbability(*pi, BB);
+
+      if (!hottest || hottestFrequency < frequency) {
+        hottest = *pi;
+        hottestFrequency = frequency;
+      }
+    }
+
+    DEBUG(errs() << "\n" << debugPrefix << "Hottest predecessor of [" << BB->getName() << "] is ["
+        << hottest->getName() << "]. ");
+
+    return hottest;
+  }
+
+
+  void AssignBlockSignatures::releaseMemory() {
+    blockSignatures.clear();
+    primaryPredecessors.clear();
+    primarySiblings.clear();
+    faninBlocks.clear();
+    faninSuccessors.clear();
+    nextID = 0;
+  }
+
+
+  std::string AssignBlockSignatures::getStableModuleName(Module &M) {
+    // The module identifier is usually a path, which changes with the build directory and would
+    // keep cached builds from being reused. Weak and linkonce definitions may be in many modules.
+    std::vector<std::string> names;
+
+    for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+      if (!fi->isDeclaration() && fi->hasExternalLinkage()) {
+        names.push_back(fi->getName());
+      }
+    }
+
+    for (Module::global_iterator gi = M.global_begin(), ge = M.global_end(); gi != ge; ++gi) {
+      if (!gi->isDeclaration() && gi->hasExternalLinkage()) {
+        names.push_back(gi->getName());
+      }
+    }
+
+    if (names.empty()) {
+      return sys::path::filename(M.getModuleIdentifier());
+    }
+
+    std::sort(names.begin(), names.end());
+
+    std::string name;
+    for (std::vector<std::string>::iterator ni = names.begin(), ne = names.end(); ni != ne; ++ni) {
+      name += *ni;
+      name += '\n';
+    }
+
+    return name;
+  }
+
+
+  uint64_t AssignBlockSignatures::chooseSignatureBase(Module &M) {
+    if (!SaltSignatures || SignatureBase.getNumOccurrences()) {
+      return SignatureBase;
+    }
+
+    // The lower half is left for the basic blocks of this module.
+    uint64_t base = moduleHash & ~uint64_t(0xffffffff);
+
+    DEBUG(errs() << debugPrefix << "Signatures for [" << M.getModuleIdentifier() << "] start at "
+        << "0x" << Twine::utohexstr(base) << ".\n");
+
+    return base;
+  }
+
+
+  void AssignBlockSignatures::recordSignatureRange(Module &M, uint64_t first, uint64_t end) {
+    // One module per line, as "<module hash> <first> <end> <module identifier>". Appending before
+    // looking for collisions makes sure that of two modules instrumented at the same time, at
+    // least the second one to read the file sees the other.
+    std::string key = Twine::utohexstr(moduleHash).str();
+
+    {
+      std::string errorInfo;
+      raw_fd_ostream index(SignatureIndex.c_str(), errorInfo, sys::fs::F_Append);
+      if (!errorInfo.empty()) {
+        report_fatal_error(Twine("CFCSS: could not write signature index ") + SignatureIndex
+            + ": " + errorInfo);
+      }
+
+      index << key << " 0x" << Twine::utohexstr(first) << " 0x" << Twine::utohexstr(end) << " "
+          << M.getModuleIdentifier() << "\n";
+    }
+
+    OwningPtr<MemoryBuffer> buffer;
+    if (error_code error = MemoryBuffer::getFile(SignatureIndex, buffer)) {
+      report_fatal_error(Twine("CFCSS: could not read signature index ") + SignatureIndex + ": "
+          + error.message());
+    }
+
+    SmallVector<StringRef, 256> lines;
+    buffer->getBuffer().split(lines, "\n", -1, false);
+
+    for (unsigned int idx = 0; idx < lines.size(); ++idx) {
+      SmallVector<StringRef, 4> fields;
+      lines[idx].split(fields, " ", 3, false);
+
+      uint64_t otherFirst = 0;
+      uint64_t otherEnd = 0;
+      if (fields.size() != 4 || fields[1].getAsInteger(0, otherFirst)
+          || fields[2].getAsInteger(0, otherEnd)) {
+
+        report_fatal_error(Twine("CFCSS: malformed line in signature index ") + SignatureIndex
+            + ": " + lines[idx]);
+      }
+
+      // Earlier builds of the same module don't count.
+      if (fields[0] == key) {
+        continue;
+      }
+
+      if (first < end && otherFirst < otherEnd && first < otherEnd && otherFirst < end) {
+        report_fatal_error(Twine("CFCSS: signatures 0x") + Twine::utohexstr(first) + " to 0x"
+            + Twine::utohexstr(end) + " of " + M.getModuleIdentifier() + " collide with those of "
+            + fields[3] + " in " + SignatureIndex + ", use -cfcss-signature-base");
+      }
+    }
+  }
+
+
+  uint64_t AssignBlockSignatures::getModuleHash() {
+    return moduleHash;
+  }
+
+
+  IntegerType* AssignBlockSignatures::chooseSignatureType(Module &M, uint64_t base) {
+    // Every basic block may need a signature of its own.
+    uint64_t numBlocks = 0;
+    for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+      numBlocks += fi->size();
+    }
+
+    // Wrapping around would hand out signatures from the ranges of other modules.
+    if (base > ~uint64_t(0) - numBlocks) {
+      report_fatal_error(Twine("CFCSS: ") + Twine(numBlocks) + " basic blocks starting at "
+          + Twine(base) + " don't fit into 64-bit signatures");
+    }
+
+    // One past the largest signature we might hand out.
+    uint64_t limit = base + numBlocks;
+
+    if (Signatures32 && SignatureWidth.getNumOccurrences()) {
+      report_fatal_error("CFCSS: -cfcss-signatures-32bit and -cfcss-signature-width can't be "
+          "given together");
+    }
+
+    unsigned int width = Signatures32 ? 32 : SignatureWidth;
+
+    if (!width) {
+      // Signatures of up to 32 bits can always be XORed with an immediate on x86-64, and so can
+      // 64-bit ones below 2^31, which is any unsalted module in practice.
+      for (width = 8; width < 64; width *= 2) {
+        if (limit <= (uint64_t(1) << width)) {
+          break;
+        }
+      }
+
+      DEBUG(errs() << debugPrefix << "Using " << width << "-bit signatures for " << numBlocks
+          << " basic blocks.\n");
+    }
+
+    if (width < 64 && limit > (uint64_t(1) << width)) {
+      report_fatal_error(Twine("CFCSS: ") + Twine(numBlocks) + " basic blocks starting at "
+          + Twine(base) + " don't fit into " + Twine(width) + "-bit signatures");
+    }
+
+    return IntegerType::get(M.getContext(), width);
+  }
+
+
+  IntegerType* AssignBlockSignatures::getSignatureType() {
+    return signatureType;
   }
 
 
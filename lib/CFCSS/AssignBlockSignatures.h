@@ -1,7 +1,11 @@
 #pragma once
 
 #include "Common.h"
+#include "SignatureRegions.h"
 
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Pass.h"
 
 namespace cfcss {
@@ -9,6 +13,16 @@ namespace cfcss {
   /**
    * Assign signatures to every basic block in a module and provide these signatures keyed by basic
    * block for later passes.
+   *
+   * The assignment is also kept in the module, so that it can be read back without running CFCSS
+   * again. The terminator of every basic block carries
+   *
+   *   !cfcss.sig !{iN signature, iN predecessorSignature, iN siblingSignature, i1 isFaninNode,
+   *       i1 hasFaninSuccessor}
+   *
+   * where the signatures of the authoritative predecessor and sibling are null if there is none,
+   * and every run adds !{i32 width, i64 first, i64 end} to !cfcss.signatures for the range of
+   * signatures it handed out.
    */
   class AssignBlockSignatures : public llvm::ModulePass {
     public:
@@ -18,6 +32,18 @@ namespace cfcss {
 
       virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
       virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
+
+      /**
+       * Get the integer type of all signatures, chosen according to -cfcss-signature-width.
+       */
+      llvm::IntegerType* getSignatureType();
+
+      /**
+       * Get a hash that tells this module apart from others linked into the same program, without
+       * depending on where it was built, see getStableModuleName().
+       */
+      uint64_t getModuleHash();
 
       /**
        * Get the signature of the given basic block, if any.
@@ -61,6 +87,51 @@ namespace cfcss {
       void notifyAboutSplitBlock(llvm::BasicBlock * const head, llvm::BasicBlock * const tail);
 
     private:
+      /**
+       * Get a name for the module that stays the same wherever it is built, made up of its
+       * strong external definitions, which no other module in the same program can have.
+       */
+      std::string getStableModuleName(llvm::Module &M);
+
+      uint64_t chooseSignatureBase(llvm::Module &M);
+      llvm::IntegerType* chooseSignatureType(llvm::Module &M, uint64_t base);
+
+      /**
+       * Add the signatures handed out in this module to -cfcss-signature-index, and fail if they
+       * overlap those of any other module in there.
+       */
+      void recordSignatureRange(llvm::Module &M, uint64_t first, uint64_t end);
+
+      /**
+       * Map predecessors of fanin nodes to an earlier sibling with the same predecessors and
+       * successors, whose signature they can share.
+       */
+      void findEquivalentSiblings(llvm::Function *F, SignatureRegions &SR,
+          BlockToBlockMap &equivalentSiblings);
+
+      /**
+       * Stop treating fanin nodes as such where all predecessors share a signature, which makes D
+       * statically zero.
+       */
+      void eliminateRuntimeAdjustment(
+          llvm::SmallVectorImpl<llvm::BasicBlock*> &functionFaninBlocks);
+
+      /**
+       * Attach !cfcss.sig to the terminators of all basic blocks in the given function.
+       */
+      void annotateBlocks(llvm::Function *F);
+
+      /**
+       * Pick the predecessor with the most frequently executed edge into the given fanin node.
+       */
+      llvm::BasicBlock* getHottestPredecessor(llvm::BasicBlock * const BB);
+
+      llvm::BlockFrequencyInfo *BFI;
+      llvm::BranchProbabilityInfo *BPI;
+
+      llvm::IntegerType *signatureType;
+      unsigned int signatureKind;
+
       BlockToSignatureMap blockSignatures;
 
       BlockToBlockMap primaryPredecessors;
@@ -69,7 +140,8 @@ namespace cfcss {
       BlockSet faninBlocks;
       // TODO(hermannloose): Rename this, since it's misleading.
       BlockSet faninSuccessors;
-      unsigned long nextID;
+      uint64_t nextID;
+      uint64_t moduleHash;
   };
 
 }
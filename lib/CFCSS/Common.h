@@ -2,6 +2,7 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
@@ -30,5 +31,20 @@ namespace cfcss {
 
   typedef std::pair<llvm::Function*, llvm::Function*> FunctionToFunctionEntry;
 
-  extern llvm::cl::opt<bool> Signatures32;
+  /**
+   * FNV-1a of the given name. Unlike hash_value(), this gives the same result across runs and LLVM
+   * versions, so that anything derived from it keeps cached builds valid.
+   */
+  inline uint64_t hashName(llvm::StringRef name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (llvm::StringRef::iterator ci = name.begin(), ce = name.end(); ci != ce; ++ci) {
+      hash = (hash ^ static_cast<unsigned char>(*ci)) * 0x100000001b3ULL;
+    }
+
+    return hash;
+  }
+
+  extern llvm::cl::opt<bool> ProfileGuided;
+  extern llvm::cl::opt<bool> IndirectCalls;
+  extern llvm::cl::opt<bool> PostInline;
 }
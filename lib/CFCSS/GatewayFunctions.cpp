@@ -3,11 +3,17 @@
 #include "GatewayFunctions.h"
 
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CallSite.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <vector>
 
 using namespace llvm;
 
@@ -15,18 +21,39 @@ static const char *debugPrefix = "GatewayFunctions: ";
 
 namespace cfcss {
 
+  llvm::cl::opt<bool> IndirectCalls("cfcss-indirect-calls",
+      llvm::cl::desc("Check indirect calls to functions defined in the module, which look up and "
+          "call the implementation behind a gateway directly. The default is to call through the "
+          "gateway, which resets GSR."));
+
   GatewayFunctions::GatewayFunctions() : ModulePass(ID), authoritativePredecessors(),
-      gatewayToInternal(), faninNodes() {
+      gatewayToInternal(), faninNodes(), indirectTargets(), indirectlyCalled() {
 
   }
 
   void GatewayFunctions::getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<CallGraph>();
+
+    if (ProfileGuided) {
+      AU.addRequired<BlockFrequencyInfo>();
+    }
   }
 
   bool GatewayFunctions::runOnModule(Module &M) {
     bool modified = false;
 
+    // Indirect calls read a short jump and the magic number of InstrumentBasicBlocks at whatever
+    // they are about to call, which only works where that jump is what the target starts with.
+    if (IndirectCalls) {
+      Triple triple(M.getTargetTriple().empty() ? sys::getDefaultTargetTriple()
+          : M.getTargetTriple());
+
+      if (triple.getArch() != Triple::x86 && triple.getArch() != Triple::x86_64) {
+        report_fatal_error(Twine("CFCSS: -cfcss-indirect-calls is only supported on x86, not on ")
+            + triple.str());
+      }
+    }
+
     CallGraph &CG = getAnalysis<CallGraph>();
 
     CallGraphNode *externalCallers = CG.getExternalCallingNode();
@@ -61,7 +88,11 @@ namespace cfcss {
           continue;
         }
 
-        if (externallyCalled->getNumReferences() < 2) {
+        // Indirect calls need an implementation to call that isn't the gateway, even if there are
+        // no direct calls.
+        bool indirectTarget = IndirectCalls && F->hasAddressTaken() && !F->isVarArg();
+
+        if (externallyCalled->getNumReferences() < 2 && !indirectTarget) {
           // TODO(hermannloose): This is a dirty hack.
           // Probably primarily confusing due to the name. Documentation could
           // make clear, that both gateways and externally visible functions
@@ -79,54 +110,25 @@ namespace cfcss {
         DEBUG(errs() << debugPrefix
             << "Creating gateway function for [" << F->getName() << "].\n");
 
-        Function *internal = cast<Function>(M.getOrInsertFunction(
-            (F->getName() + "_cfcss_internal").str(),
-            F->getFunctionType(),
-            F->getAttributes()));
+        Function *internal = Function::Create(F->getFunctionType(),
+            GlobalValue::InternalLinkage, F->getName() + "_cfcss_internal", &M);
+        internal->copyAttributesFrom(F);
+        internal->setVisibility(GlobalValue::DefaultVisibility);
 
-        ValueToValueMapTy VMap;
-        SmallVector<ReturnInst*, 64> returns;
+        // Move the body over instead of cloning it, the gateway only needs a call to it.
+        internal->getBasicBlockList().splice(internal->begin(), F->getBasicBlockList());
 
-        // Map function arguments by hand, since the Cloning API is a bit retarded.
-        for (auto ai = F->arg_begin(), ae = F->arg_end(),
-            nai = internal->arg_begin(), nae = internal->arg_end();
-            ai != ae && nai != nae;
-            ++ai, ++nai) {
+        for (Function::arg_iterator ai = F->arg_begin(), ae = F->arg_end(),
+            nai = internal->arg_begin(); ai != ae; ++ai, ++nai) {
 
-          VMap[ai] = nai;
+          ai->replaceAllUsesWith(nai);
+          nai->takeName(ai);
         }
 
-        CloneFunctionInto(internal, F, VMap, false, returns);
-
-        internal->setLinkage(GlobalValue::InternalLinkage);
-
+        // The call sites moved along with the body, and so do their call graph edges.
         CallGraphNode *internalNode = CG.getOrInsertFunction(internal);
         externalCallers->removeAnyCallEdgeTo(internalNode);
-
-        // TODO(hermannloose): Maybe CallGraphNode::stealCalledFunctionsFrom can be used for this?
-        // Recreate call graph edges for cloned call and invoke instructions.
-        for (auto bi = internal->begin(), be = internal->end(); bi != be; ++bi) {
-          for (auto ii = bi->begin(), ie = bi->end(); ii != ie; ++ii) {
-            if (CallInst *callInst = dyn_cast<CallInst>(ii)) {
-              if (Function *calledFunction = callInst->getCalledFunction()) {
-                // Adding call graph edges for intrinsics would trip an assertion in CallGraph.h.
-                if (!calledFunction->isIntrinsic()) {
-                  internalNode->addCalledFunction(CallSite(callInst), CG[calledFunction]);
-                }
-              }
-            }
-            if (InvokeInst *invokeInst = dyn_cast<InvokeInst>(ii)) {
-              if (Function *calledFunction = invokeInst->getCalledFunction()) {
-                // See comment above.
-                if (!calledFunction->isIntrinsic()) {
-                  internalNode->addCalledFunction(CallSite(invokeInst), CG[calledFunction]);
-                }
-              }
-            }
-          }
-        }
-
-        F->deleteBody();
+        internalNode->stealCalledFunctionsFrom(externallyCalled);
 
         // TODO(hermannloose): Figure out how to do this in one line.
         std::vector<Value*> argumentVector;
@@ -139,6 +141,8 @@ namespace cfcss {
         IRBuilder<> builder(entry);
 
         CallInst *forwardCall = builder.CreateCall(internal, ArrayRef<Value*>(argumentVector));
+        forwardCall->setCallingConv(internal->getCallingConv());
+        forwardCall->setTailCall();
 
         ReturnInst *forwardReturn = NULL;
         if (F->getReturnType()->isVoidTy()) {
@@ -147,52 +151,98 @@ namespace cfcss {
           forwardReturn = builder.CreateRet(forwardCall);
         }
 
-        externallyCalled->removeAllCalledFunctions();
         externallyCalled->addCalledFunction(CallSite(forwardCall), internalNode);
 
         gatewayToInternal.insert(FunctionToFunctionEntry(F, internal));
 
+        if (indirectTarget) {
+          DEBUG(errs() << debugPrefix << "[" << internal->getName() << "] may be called "
+              << "indirectly.\n");
+
+          indirectTargets.push_back(F);
+          indirectlyCalled.insert(internal);
+        }
+
         modified = true;
       } else {
         assert(false && "The external calling node should only call actual functions.");
       }
     }
 
-    // TODO(hermannloose): This is a quick and dirty hack in the wrong place.
     // Update all direct calls to the original function within the module to refer to the internal
-    // function instead. Function pointers, bitcasts of functions etc. still go through the gateway
-    // as we still lack proper support for them.
-    for (auto fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
-      CallGraphNode *callerNode = CG[fi];
-      for (auto bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
-        for (auto ii = bi->begin(), ie = bi->end(); ii != ie; ++ii) {
-          if (CallInst *callInst = dyn_cast<CallInst>(ii)) {
-            if (Function *calledFunction = callInst->getCalledFunction()) {
-              if (gatewayToInternal.count(calledFunction)) {
-                callerNode->removeCallEdgeFor(CallSite(callInst));
-
-                Function *internal = gatewayToInternal.lookup(calledFunction);
-                callInst->setCalledFunction(internal);
-
-                callerNode->addCalledFunction(CallSite(callInst), CG[internal]);
-              }
-            }
-          }
+    // function instead. Function pointers, bitcasts of functions etc. still go through the gateway,
+    // see -cfcss-indirect-calls.
+    for (FunctionToFunctionMap::iterator gi = gatewayToInternal.begin(),
+        ge = gatewayToInternal.end(); gi != ge; ++gi) {
+
+      Function *gateway = gi->first;
+      Function *internal = gi->second;
+
+      if (gateway == internal) {
+        continue;
+      }
+
+      SmallVector<CallSite, 16> callSites;
+      for (Value::use_iterator ui = gateway->use_begin(), ue = gateway->use_end(); ui != ue;
+          ++ui) {
+
+        CallSite callSite(*ui);
+        if (callSite && callSite.isCallee(ui)) {
+          callSites.push_back(callSite);
         }
       }
+
+      for (SmallVectorImpl<CallSite>::iterator ci = callSites.begin(), ce = callSites.end();
+          ci != ce; ++ci) {
+
+        CallGraphNode *callerNode = CG[ci->getInstruction()->getParent()->getParent()];
+        callerNode->removeCallEdgeFor(*ci);
+
+        ci->setCalledFunction(internal);
+
+        callerNode->addCalledFunction(*ci, CG[internal]);
+      }
     }
 
     // Determine authoritative predecessors.
+    DenseMap<Function*, double> authoritativeCallFrequencies;
+
     for (CallGraph::iterator ci = CG.begin(), ce = CG.end(); ci != ce; ++ci) {
       CallGraphNode *caller = ci->second;
       if (Function *callerFunction = caller->getFunction()) {
+        BlockFrequencyInfo *BFI = NULL;
+        if (ProfileGuided && !callerFunction->isDeclaration() && !caller->empty()) {
+          BFI = &getAnalysis<BlockFrequencyInfo>(*callerFunction);
+        }
+
         for (CallGraphNode::iterator callee_i = caller->begin(), callee_e = caller->end();
             callee_i != callee_e; ++callee_i) {
 
           CallGraphNode *callee = callee_i->second;
 
           if (Function *calleeFunction = callee->getFunction()) {
-            if (!authoritativePredecessors.count(calleeFunction)) {
+            Value *callSite = callee_i->first;
+            Instruction *callInst = dyn_cast_or_null<Instruction>(callSite);
+
+            if (BFI && callInst) {
+              // Block frequencies are only meaningful relative to the entry of the function they
+              // were computed for, which is the best we can do to compare call sites in
+              // different callers.
+              double frequency =
+                  double(BFI->getBlockFreq(callInst->getParent()).getFrequency())
+                  / BFI->getBlockFreq(&callerFunction->getEntryBlock()).getFrequency();
+
+              if (!authoritativePredecessors.count(calleeFunction)
+                  || authoritativeCallFrequencies.lookup(calleeFunction) < frequency) {
+
+                DEBUG(errs() << debugPrefix << "Setting [" << callerFunction->getName() << "] as "
+                    << "authoritative predecessor of [" << calleeFunction->getName() << "] "
+                    << "(relative call frequency " << frequency << ").\n");
+
+                authoritativePredecessors[calleeFunction] = callerFunction;
+                authoritativeCallFrequencies[calleeFunction] = frequency;
+              }
+            } else if (!authoritativePredecessors.count(calleeFunction)) {
               DEBUG(errs() << debugPrefix << "Setting [" << callerFunction->getName() << "] as "
                   << "authoritative predecessor of [" << calleeFunction->getName() << "].\n");
 
@@ -215,9 +265,24 @@ namespace cfcss {
       }
     }
 
+    // Indirect calls may come from any block, so they always have to set D.
+    for (FunctionSet::iterator fi = indirectlyCalled.begin(), fe = indirectlyCalled.end();
+        fi != fe; ++fi) {
+
+      faninNodes.insert(*fi);
+    }
+
     return modified;
   }
 
+  void GatewayFunctions::releaseMemory() {
+    authoritativePredecessors.clear();
+    gatewayToInternal.clear();
+    faninNodes.clear();
+    indirectTargets.clear();
+    indirectlyCalled.clear();
+  }
+
   bool GatewayFunctions::isGateway(Function * const F) {
     return gatewayToInternal.count(F);
   }
@@ -234,6 +299,14 @@ namespace cfcss {
     return faninNodes.count(F);
   }
 
+  ArrayRef<Function*> GatewayFunctions::getIndirectTargets() {
+    return indirectTargets;
+  }
+
+  bool GatewayFunctions::isIndirectTarget(Function * const F) {
+    return indirectlyCalled.count(F);
+  }
+
   char GatewayFunctions::ID = 0;
 }
 
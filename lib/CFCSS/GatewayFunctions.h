@@ -2,22 +2,30 @@
 
 #include "Common.h"
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
+#include <vector>
+
 namespace cfcss {
 
   /**
    * Wrap externally visible functions with a gateway function to later establish a known good
    * state for CFCSS regarding the contents of GSR and D.
    *
-   * For all externally visible functions, this will rename the original function and change it to
-   * have internal linkage. It then adds a new externally visible function with the same signature
-   * as a gateway that forwards calls to the private implementation and returns the result.
+   * For all externally visible functions, this will move the body of the original function into
+   * a new function with internal linkage. The original function is left as a gateway, a thunk
+   * that forwards calls to the private implementation and returns the result.
    * Instrumentation of the gateway will later concern itself with setting GSR and D to sensible
    * starting values. All calls from within the module to the original function bypass the gateway
    * and go directly to the implementation, since they will carry actual signatures in GSR and
    * D that we want to check upon entering the called function.
+   *
+   * Function pointers keep referring to the gateway, since they may escape and be called from
+   * anywhere. With -cfcss-indirect-calls, every function whose address is taken gets a separate
+   * implementation this way, which indirect calls from within the module can look up and call
+   * directly.
    */
   class GatewayFunctions : public llvm::ModulePass {
     public:
@@ -27,6 +35,7 @@ namespace cfcss {
 
       virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
       virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
 
       /**
        * Check whether a function is a gateway, used in instrumentation.
@@ -48,10 +57,25 @@ namespace cfcss {
        */
       bool isFaninNode(llvm::Function * const F);
 
+      /**
+       * Get the gateways of all functions whose address is taken, if -cfcss-indirect-calls is
+       * given. Indirect calls may reach the internal functions behind these.
+       */
+      llvm::ArrayRef<llvm::Function*> getIndirectTargets();
+
+      /**
+       * Check whether the given internal function may be called indirectly, i.e. through a table
+       * lookup on the address of its gateway.
+       */
+      bool isIndirectTarget(llvm::Function * const F);
+
     private:
       FunctionToFunctionMap authoritativePredecessors;
       FunctionToFunctionMap gatewayToInternal;
       FunctionSet faninNodes;
+
+      std::vector<llvm::Function*> indirectTargets;
+      FunctionSet indirectlyCalled;
   };
 
 }
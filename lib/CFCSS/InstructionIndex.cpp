@@ -2,10 +2,16 @@
 
 #include "InstructionIndex.h"
 
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/InlineAsm.h"
+
+#include "llvm/Support/CallSite.h"
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 static const char *debugPrefix = "InstructionIndex: ";
@@ -18,11 +24,18 @@ namespace cfcss {
 
 
   void InstructionIndex::getAnalysisUsage(AnalysisUsage &AU) const {
+    if (ProfileGuided) {
+      AU.addRequired<BlockFrequencyInfo>();
+    }
+
     AU.setPreservesAll();
   }
 
 
   bool InstructionIndex::runOnModule(Module &M) {
+    // Reused for every function before its primary calls are copied over in sorted order.
+    DenseMap<Function*, Instruction*> functionPrimaryCalls;
+
     for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
       if (fi->isDeclaration()) {
         continue;
@@ -30,37 +43,61 @@ namespace cfcss {
 
       DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "] ... ");
 
-      CallList *callList = new CallList();
-      callsByFunction.insert(std::pair<Function*, CallList*>(fi, callList));
+      FunctionEntry entry;
+      entry.callsBegin = calls.size();
+      entry.indirectCallsBegin = indirectCalls.size();
+      entry.returnsBegin = returns.size();
 
-      PrimaryCallMap *primaryCalls = new PrimaryCallMap();
-      primaryCallsByFunction.insert(std::pair<Function*, PrimaryCallMap*>(fi, primaryCalls));
+      functionPrimaryCalls.clear();
 
-      ReturnList *returnList = new ReturnList();
-      returnsByFunction.insert(std::pair<Function*, ReturnList*>(fi, returnList));
+      BlockFrequencyInfo *BFI = NULL;
+      if (ProfileGuided) {
+        BFI = &getAnalysis<BlockFrequencyInfo>(*fi);
+      }
 
       for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
         for (BasicBlock::iterator ii = bi->begin(), ie = bi->end(); ii != ie; ++ii) {
-          if (CallInst *callInst = dyn_cast<CallInst>(ii)) {
-            if (Function *calledFunction = callInst->getCalledFunction()) {
+          if (CallSite callSite = CallSite(&*ii)) {
+            if (Function *calledFunction = callSite.getCalledFunction()) {
               if (!calledFunction->isDeclaration() && !calledFunction->isIntrinsic()) {
-                callList->push_back(callInst);
-
-                if (!primaryCalls->count(calledFunction)) {
-                  primaryCalls->insert(std::pair<Function*, CallInst*>(calledFunction, callInst));
+                calls.push_back(ii);
+
+                std::pair<DenseMap<Function*, Instruction*>::iterator, bool> primaryCall =
+                    functionPrimaryCalls.insert(std::make_pair(calledFunction, &*ii));
+
+                if (!primaryCall.second && BFI) {
+                  // Make the most frequently executed call site the primary one, so signature
+                  // adjustments for the called function happen on colder paths.
+                  Instruction *&primary = primaryCall.first->second;
+                  if (BFI->getBlockFreq(primary->getParent()) < BFI->getBlockFreq(bi)) {
+                    primary = ii;
+                  }
                 }
               }
-            } else {
-              // TODO(hermannloose): Handle function pointers & inline asm.
+            } else if (IndirectCalls && !isa<InlineAsm>(callSite.getCalledValue())) {
+              indirectCalls.push_back(ii);
             }
           }
 
           if (ReturnInst *returnInst = dyn_cast<ReturnInst>(ii)) {
-            returnList->push_back(returnInst);
+            returns.push_back(returnInst);
           }
         }
       }
 
+      entry.callsEnd = calls.size();
+      entry.indirectCallsEnd = indirectCalls.size();
+      entry.returnsEnd = returns.size();
+
+      entry.primaryCallsBegin = primaryCalls.size();
+      primaryCalls.insert(primaryCalls.end(), functionPrimaryCalls.begin(),
+          functionPrimaryCalls.end());
+      entry.primaryCallsEnd = primaryCalls.size();
+
+      std::sort(primaryCalls.begin() + entry.primaryCallsBegin, primaryCalls.end());
+
+      functionEntries.insert(std::make_pair(fi, entry));
+
       DEBUG(
         errs().changeColor(raw_ostream::GREEN);
         errs() << "done\n";
@@ -72,35 +109,65 @@ namespace cfcss {
   }
 
 
-  CallList* InstructionIndex::getCalls(Function * const F) {
-    return callsByFunction.lookup(F);
+  void InstructionIndex::releaseMemory() {
+    DenseMap<Function*, FunctionEntry>().swap(functionEntries);
+    std::vector<Instruction*>().swap(calls);
+    std::vector<Instruction*>().swap(indirectCalls);
+    std::vector<PrimaryCall>().swap(primaryCalls);
+    std::vector<ReturnInst*>().swap(returns);
   }
 
 
-  CallInst* InstructionIndex::getPrimaryCallTo(Function * const target,
+  CallList InstructionIndex::getCalls(Function * const F) {
+    FunctionEntry entry = functionEntries.lookup(F);
+
+    return CallList(calls).slice(entry.callsBegin, entry.callsEnd - entry.callsBegin);
+  }
+
+
+  CallList InstructionIndex::getIndirectCalls(Function * const F) {
+    FunctionEntry entry = functionEntries.lookup(F);
+
+    return CallList(indirectCalls).slice(entry.indirectCallsBegin,
+        entry.indirectCallsEnd - entry.indirectCallsBegin);
+  }
+
+
+  Instruction* InstructionIndex::getPrimaryCallTo(Function * const target,
       Function * const container) {
 
-    PrimaryCallMap *primaryCalls = primaryCallsByFunction.lookup(container);
+    FunctionEntry entry = functionEntries.lookup(container);
+
+    std::vector<PrimaryCall>::iterator begin = primaryCalls.begin() + entry.primaryCallsBegin;
+    std::vector<PrimaryCall>::iterator end = primaryCalls.begin() + entry.primaryCallsEnd;
+    std::vector<PrimaryCall>::iterator primaryCall =
+        std::lower_bound(begin, end, PrimaryCall(target, NULL));
 
-    return primaryCalls->lookup(target);
+    if (primaryCall == end || primaryCall->first != target) {
+      return NULL;
+    }
+
+    return primaryCall->second;
   }
 
 
   bool InstructionIndex::doesNotReturn(Function * const F) {
-    return F->doesNotReturn() || returnsByFunction.lookup(F)->empty();
+    return F->doesNotReturn() || getReturns(F).empty();
   }
 
 
-  ReturnList* InstructionIndex::getReturns(Function * const F) {
-    return returnsByFunction.lookup(F);
+  ReturnList InstructionIndex::getReturns(Function * const F) {
+    FunctionEntry entry = functionEntries.lookup(F);
+
+    return ReturnList(returns).slice(entry.returnsBegin, entry.returnsEnd - entry.returnsBegin);
   }
 
 
   ReturnInst* InstructionIndex::getPrimaryReturn(Function * const F) {
-    ReturnList* returns = returnsByFunction.lookup(F);
-    assert(!returns->empty());
+    ReturnList functionReturns = getReturns(F);
+    assert(!functionReturns.empty());
 
-    return returns->front();
+    return functionReturns.front();
   }
 
 
@@ -2,17 +2,27 @@
 
 #include "Common.h"
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
+#include <vector>
+
 namespace cfcss {
 
-  typedef std::list<llvm::CallInst*> CallList;
-  typedef std::list<llvm::ReturnInst*> ReturnList;
+  /**
+   * Call sites, i.e. calls and invokes, to functions defined in the module, in program order.
+   */
+  typedef llvm::ArrayRef<llvm::Instruction*> CallList;
+  typedef llvm::ArrayRef<llvm::ReturnInst*> ReturnList;
 
   /**
    * Gather interesting instructions—calls, invokes and returns—for lookup by other CFCSS passes.
+   *
+   * Instructions are kept in a few flat arrays shared by all functions, each function owning
+   * a contiguous range in each of them.
    */
   class InstructionIndex : public llvm::ModulePass {
 
@@ -23,17 +33,24 @@ namespace cfcss {
 
       virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
       virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
+
+      /**
+       * Get all call sites contained in the given function.
+       */
+      CallList getCalls(llvm::Function * const F);
 
       /**
-       * Get a list of all call instructions contained in the given function.
+       * Get all calls and invokes through function pointers contained in the given function, if
+       * -cfcss-indirect-calls is given. Inline assembly is not included.
        */
-      CallList* getCalls(llvm::Function * const F);
+      CallList getIndirectCalls(llvm::Function * const F);
 
       /**
-       * Get the primary call instruction referring to the given target, contained within the given
+       * Get the primary call site referring to the given target, contained within the given
        * function.
        */
-      llvm::CallInst* getPrimaryCallTo(llvm::Function * const target,
+      llvm::Instruction* getPrimaryCallTo(llvm::Function * const target,
           llvm::Function * const container);
 
       /**
@@ -44,14 +61,14 @@ namespace cfcss {
        * propagated as expected. We use this as a workaround to not split basic blocks after calls
        * to such functions.
        *
-       * This is equivalent to getReturns()->empty().
+       * This is equivalent to getReturns().empty().
        */
       bool doesNotReturn(llvm::Function * const F);
 
       /**
-       * Get a list of all return instructions contained in the given function.
+       * Get all return instructions contained in the given function.
        */
-      ReturnList* getReturns(llvm::Function * const F);
+      ReturnList getReturns(llvm::Function * const F);
 
       /**
        * Get the primary return instruction of the given function.
@@ -61,12 +78,34 @@ namespace cfcss {
       llvm::ReturnInst* getPrimaryReturn(llvm::Function * const F);
 
     private:
-      llvm::DenseMap<llvm::Function*, CallList*> callsByFunction;
+      /**
+       * Ranges owned by a function in calls, indirectCalls, primaryCalls and returns.
+       */
+      struct FunctionEntry {
+        FunctionEntry() : callsBegin(0), callsEnd(0), indirectCallsBegin(0), indirectCallsEnd(0),
+            primaryCallsBegin(0), primaryCallsEnd(0), returnsBegin(0), returnsEnd(0) {}
+
+        unsigned int callsBegin;
+        unsigned int callsEnd;
+        unsigned int indirectCallsBegin;
+        unsigned int indirectCallsEnd;
+        unsigned int primaryCallsBegin;
+        unsigned int primaryCallsEnd;
+        unsigned int returnsBegin;
+        unsigned int returnsEnd;
+      };
+
+      /**
+       * Called function and primary call site, sorted by called function within each range.
+       */
+      typedef std::pair<llvm::Function*, llvm::Instruction*> PrimaryCall;
 
-      typedef llvm::DenseMap<llvm::Function*, llvm::CallInst*> PrimaryCallMap;
-      llvm::DenseMap<llvm::Function*, PrimaryCallMap*> primaryCallsByFunction;
+      llvm::DenseMap<llvm::Function*, FunctionEntry> functionEntries;
 
-      llvm::DenseMap<llvm::Function*, ReturnList*> returnsByFunction;
+      std::vector<llvm::Instruction*> calls;
+      std::vector<llvm::Instruction*> indirectCalls;
+      std::vector<PrimaryCall> primaryCalls;
+      std::vector<llvm::ReturnInst*> returns;
   };
 
 }
@@ -8,27 +8,125 @@
 #include "SplitAfterCall.h"
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/IR/CallingConv.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/CFG.h"
+#include "llvm/Support/CallSite.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
+#include <algorithm>
 #include <stdio.h>
+#include <vector>
 
 using namespace llvm;
 
 static const char *debugPrefix = "InstrumentBasicBlocks: ";
 
 namespace cfcss {
+
+  static llvm::cl::opt<bool> SSARegisters("cfcss-ssa-registers",
+      llvm::cl::desc("Keep GSR and D in SSA registers instead of stack slots. The default is to "
+          "leave their allocas for mem2reg to clean up."));
+
+  static llvm::cl::opt<bool> DeferredChecks("cfcss-deferred-checks",
+      llvm::cl::desc("Fold signature mismatches into a per-function error accumulator instead of "
+          "branching in every basic block, and only branch on it at check points. Unless "
+          "-cfcss-check-policy says otherwise, these are calls, returns and loop back-edges."));
+
+  static llvm::cl::list<CheckPoint> CheckPolicy("cfcss-check-policy",
+      llvm::cl::CommaSeparated,
+      llvm::cl::desc("Where to compare GSR against the expected signature. Every basic block still "
+          "updates GSR. The default is to check in every basic block."),
+      llvm::cl::values(
+          clEnumValN(CheckEveryBlock, "all", "Check in every basic block"),
+          clEnumValN(CheckBeforeStores, "stores", "Check in basic blocks that write to memory"),
+          clEnumValN(CheckBeforeCalls, "calls", "Check in basic blocks that call functions"),
+          clEnumValN(CheckBeforeReturns, "returns", "Check in basic blocks that return"),
+          clEnumValN(CheckBackEdges, "backedges", "Check in basic blocks with loop back-edges"),
+          clEnumValEnd));
+
+  static llvm::cl::opt<unsigned> CheckInterval("cfcss-check-interval",
+      llvm::cl::desc("Additionally check at least every N basic blocks along any path, and at all "
+          "loop headers. The default of 0 disables this."),
+      llvm::cl::init(0));
+
+  static llvm::cl::opt<bool> OutlineColdChecks("cfcss-outline-cold-checks",
+      llvm::cl::desc("Check signatures through calls to shared check functions instead of a "
+          "compare and branch in rarely executed basic blocks and in functions marked cold, "
+          "optsize or minsize. This trades speed in cold code for size, frequently executed "
+          "basic blocks keep the inline check."));
+
+  static llvm::cl::opt<std::string> FaultHook("cfcss-fault-hook",
+      llvm::cl::desc("Call the given function with the failed check, the expected signature and "
+          "the observed GSR upon a signature mismatch instead of trapping, and carry on with the "
+          "expected signature if it returns. Deferred checks pass the accumulated error instead "
+          "of GSR. lib/Runtime provides cfcss_signature_fault."),
+      llvm::cl::value_desc("function"));
+
+  static llvm::cl::opt<bool> ProfileChecks("cfcss-profile-checks",
+      llvm::cl::desc("Count how often each signature update and runtime adjusting signature "
+          "executes. lib/Runtime writes the counts to $CFCSS_PROFILE, cfcss.profile by default, "
+          "at exit."));
+
+  static llvm::cl::opt<std::string> CheckProfile("cfcss-check-profile",
+      llvm::cl::desc("Use the counts written with -cfcss-profile-checks instead of estimated block "
+          "frequencies to find cold checks for -cfcss-outline-cold-checks. Counts are matched by "
+          "module, function and block signature. Functions whose signatures changed since "
+          "profiling, e.g. with different input or CFCSS options, fall back to estimated "
+          "frequencies with a warning."),
+      llvm::cl::value_desc("file"));
+
+  // Basic blocks estimated to run less than once per this many entries to their function count
+  // as cold for -cfcss-outline-cold-checks.
+  static const uint64_t ColdBlockRatio = 32;
+
+  // Branch weights for signature checks, telling block placement and the branch predictor that
+  // the fault path is practically never taken.
+  static const uint32_t CheckPassedWeight = 1 << 20;
+  static const uint32_t SignatureFaultWeight = 1;
+
+  // Size of the prefix data of indirectly called gateways, see indirectTargetHeaderType.
+  static uint64_t getIndirectTargetHeaderSize(IntegerType *intType) {
+    return 2 + 4 + 4 + 2 * intType->getBitWidth() / 8;
+  }
+
+  STATISTIC(NumChecks, "Number of signature checks inserted");
+  STATISTIC(NumUncheckedUpdates, "Number of signature updates inserted without a check");
+  STATISTIC(NumOutlinedChecks, "Number of signature checks calling a shared check function");
+  STATISTIC(NumIndirectCalls, "Number of indirect calls looking up their target");
+  STATISTIC(NumFaultSites, "Number of signature checks reporting to the fault hook");
+  STATISTIC(NumProfileCounters, "Number of execution counters inserted for profiling");
+
   InstrumentBasicBlocks::InstrumentBasicBlocks() : ModulePass(ID),
-      ignoreBlocks() {}
+      ignoreBlocks(), ERR(NULL), checkAllBlocks(true), checkedBlocks(), outlinedBlocks(),
+      checkFunction(NULL), adjustingCheckFunction(NULL), indirectTargetHeaderType(NULL),
+      indirectTargetTable(NULL), unknownIndirectTarget(NULL), indirectTargetMagic(0),
+      indirectTargetLookups(), faultHook(NULL), faultSiteType(NULL), numFaultSites(0),
+      functionNames(), profileCounters(NULL), profileEntries(), checkProfile(),
+      signatureFingerprint(0) {}
 
 
   void InstrumentBasicBlocks::getAnalysisUsage(AnalysisUsage &AU) const {
@@ -37,6 +135,15 @@ namespace cfcss {
     AU.addRequiredTransitive<RemoveCFGAliasing>();
     AU.addRequiredTransitive<AssignBlockSignatures>();
     AU.addRequiredTransitive<InstructionIndex>();
+    AU.addRequiredTransitive<SignatureRegions>();
+
+    if (SSARegisters || PostInline) {
+      AU.addRequired<DominatorTree>();
+    }
+
+    if (OutlineColdChecks) {
+      AU.addRequired<BlockFrequencyInfo>();
+    }
 
     // TODO(hermannloose): AU.setPreservesAll() would probably not hurt.
     AU.addPreserved<AssignBlockSignatures>();
@@ -44,6 +151,7 @@ namespace cfcss {
     AU.addPreserved<RemoveCFGAliasing>();
     AU.addPreserved<SplitAfterCall>();
     AU.addPreserved<InstructionIndex>();
+    AU.addPreserved<SignatureRegions>();
   }
 
 
@@ -53,13 +161,12 @@ namespace cfcss {
     SAC = &getAnalysis<SplitAfterCall>();
     RemoveCFGAliasing *RCA = &getAnalysis<RemoveCFGAliasing>();
     ABS = &getAnalysis<AssignBlockSignatures>();
+    SR = &getAnalysis<SignatureRegions>();
 
-    IntegerType *intType = NULL;
-    if (Signatures32) {
-      intType = Type::getInt32Ty(getGlobalContext());
-    } else {
-      intType = Type::getInt64Ty(getGlobalContext());
-    }
+    IntegerType *intType = ABS->getSignatureType();
+
+    // Modules instrumented with different signature widths must not end up sharing these.
+    std::string suffix = intType->getBitWidth() == 64 ? "" : utostr(intType->getBitWidth());
 
     interFunctionGSR = new GlobalVariable(
         M,
@@ -67,7 +174,7 @@ namespace cfcss {
         false, /* isConstant */
         GlobalValue::LinkOnceAnyLinkage,
         ConstantInt::get(intType, 0),
-        "interFunctionGSR");
+        "interFunctionGSR" + suffix);
 
     interFunctionGSR->setThreadLocal(true);
 
@@ -77,10 +184,59 @@ namespace cfcss {
         false, /* isConstant */
         GlobalValue::LinkOnceAnyLinkage,
         ConstantInt::get(intType, 0),
-        "interFunctionD");
+        "interFunctionD" + suffix);
 
     interFunctionD->setThreadLocal(true);
 
+    // Only declare the fault handler for now, so that we don't try to instrument it below.
+    signatureFaultHandler = Function::Create(
+        FunctionType::get(Type::getVoidTy(getGlobalContext()), false),
+        GlobalValue::InternalLinkage,
+        "cfcss.handleSignatureFault",
+        &M);
+
+    checkWeights = MDBuilder(getGlobalContext()).createBranchWeights(
+        CheckPassedWeight, SignatureFaultWeight);
+
+    if (!CheckProfile.empty()) {
+      readCheckProfile(M);
+    }
+
+    profileCounters = NULL;
+    if (ProfileChecks) {
+      // Replaced by the actual counter array once we know how many counters there are.
+      profileCounters = new GlobalVariable(
+          M,
+          Type::getInt64Ty(getGlobalContext()),
+          false, /* isConstant */
+          GlobalValue::ExternalLinkage,
+          NULL,
+          "cfcss.checkCounters");
+    }
+
+    faultHook = NULL;
+    numFaultSites = 0;
+    if (!FaultHook.empty()) {
+      Type *int8PtrType = Type::getInt8PtrTy(getGlobalContext());
+      Type *int32Type = Type::getInt32Ty(getGlobalContext());
+      Type *int64Type = Type::getInt64Ty(getGlobalContext());
+
+      // Function name, check number, fault count and the runtime's list link.
+      faultSiteType = StructType::get(int8PtrType, int32Type, int64Type, int8PtrType, NULL);
+
+      faultHook = M.getOrInsertFunction(FaultHook, Type::getVoidTy(getGlobalContext()),
+          faultSiteType->getPointerTo(), int64Type, int64Type, NULL);
+    }
+
+    // Declared on first use, and defined along with the fault handler below.
+    checkFunction = NULL;
+    adjustingCheckFunction = NULL;
+
+    indirectTargetTable = NULL;
+    if (!GF->getIndirectTargets().empty()) {
+      createIndirectTargetTable(M);
+    }
+
     for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
       if (fi->isDeclaration()) {
         DEBUG(errs() << debugPrefix << "Skipping [" << fi->getName() << "] (declaration)\n");
@@ -96,18 +252,32 @@ namespace cfcss {
 
       DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "].\n");
 
+      signatureFingerprint = getSignatureFingerprint(fi);
+
+      // Check points are chosen on the uninstrumented function, or the stores initializing the
+      // CFCSS "registers" below would put a check into every entry block.
+      selectCheckedBlocks(fi);
+      selectOutlinedBlocks(fi);
+
       // Initialize CFCSS "registers", i.e. local variables.
 
       BasicBlock *entryBlock = &fi->getEntryBlock();
       IRBuilder<> builder(entryBlock->getFirstNonPHI());
 
-      Value *GSR = builder.CreateAlloca(intType, 0, "GSR");
-      Value *D = builder.CreateAlloca(intType, 0, "D");
+      AllocaInst *GSR = builder.CreateAlloca(intType, 0, "GSR");
+      AllocaInst *D = builder.CreateAlloca(intType, 0, "D");
 
       builder.CreateStore(ConstantInt::get(intType, 0), GSR);
       builder.CreateStore(ConstantInt::get(intType, 0), D);
 
-      BasicBlock *errorHandlingBlock = createErrorHandlingBlock(fi);
+      ERR = NULL;
+      if (DeferredChecks) {
+        ERR = builder.CreateAlloca(intType, 0, "ERR");
+        builder.CreateStore(ConstantInt::get(intType, 0), ERR);
+      }
+
+      // Checks reporting to the fault hook get a block of their own each.
+      BasicBlock *errorHandlingBlock = faultHook ? NULL : createErrorHandlingBlock(fi);
 
       // All instrumented functions store at least once to the global interFunctionGSR, yet they
       // might have previously been annotated as read-only or read-none.
@@ -125,11 +295,14 @@ namespace cfcss {
         Signature *signature = ABS->getSignature(entryBlock);
         builder.CreateStore(signature, GSR);
 
+        // Gateways set rather than update GSR, but their entry count is needed all the same.
+        insertProfileCounter(entryBlock, ProfileSignatureUpdate, &builder);
+
         Function *internal = GF->getInternalFunction(fi);
         if (GF->isFaninNode(internal)) {
           // TODO(hermannloose): Duplication below, factor out.
           Function *authoritativePredecessor = GF->getAuthoritativePredecessor(internal);
-          CallInst *callSite = II->getPrimaryCallTo(internal, authoritativePredecessor);
+          Instruction *callSite = II->getPrimaryCallTo(internal, authoritativePredecessor);
           assert(callSite && "Function should have an authoritative call site!");
           BasicBlock *callingBlock = callSite->getParent();
           assert(callingBlock && "Call site should be part of a basic block!");
@@ -143,7 +316,7 @@ namespace cfcss {
       } else {
         Function *authoritativePredecessor = GF->getAuthoritativePredecessor(fi);
         assert(authoritativePredecessor && "Function should have an authoritative predecessor!");
-        CallInst *callSite = II->getPrimaryCallTo(fi, authoritativePredecessor);
+        Instruction *callSite = II->getPrimaryCallTo(fi, authoritativePredecessor);
         assert(callSite && "Function should have an authoritative call site!");
         BasicBlock *callingBlock = callSite->getParent();
         assert(callingBlock && "Call site should be part of a basic block!");
@@ -151,8 +324,12 @@ namespace cfcss {
         ConstantInt *predecessorSignature = ABS->getSignature(callingBlock);
         assert(predecessorSignature && "Calling basic block should have a signature!");
 
-        builder.CreateStore(builder.CreateLoad(interFunctionGSR, "GSR"), GSR);
-        builder.CreateStore(builder.CreateLoad(interFunctionD, "D"), D);
+        LoadInst *entryGSR = builder.CreateLoad(interFunctionGSR, "GSR");
+        LoadInst *entryD = builder.CreateLoad(interFunctionD, "D");
+        builder.CreateStore(entryGSR, GSR);
+        builder.CreateStore(entryD, D);
+
+        entryLoads.insert(std::make_pair(fi, StateLoads(entryGSR, entryD)));
 
         BasicBlock *entryBlockRemainder = insertSignatureUpdate(
             entryBlock,
@@ -162,6 +339,7 @@ namespace cfcss {
             ABS->getSignature(entryBlock),
             predecessorSignature,
             GF->isFaninNode(fi), /* adjustForFanin */
+            isCheckedBlock(entryBlock), /* check */
             &builder);
 
         // TODO(hermannloose): Move somewhere else, this stuff is all over the
@@ -182,24 +360,70 @@ namespace cfcss {
           continue;
         }
 
-        builder.SetInsertPoint(bi->getFirstNonPHI());
+        // Landing pads have to start with their landingpad instruction.
+        builder.SetInsertPoint(bi, bi->getFirstInsertionPt());
 
         BasicBlock *remainder = NULL;
 
-        if (SAC->wasSplitAfterCall(bi)) {
+        if (!SR->isRegionHead(bi)) {
+          // GSR already holds the signature of the region, which was updated and checked at its
+          // head.
+          remainder = bi;
+
+        } else if (SAC->wasSplitAfterCall(bi) && !SAC->getCalledFunctionForReturnBlock(bi)) {
+          // Returning from an indirect call only picks up GSR from functions of this module, any
+          // other callee leaves it as it was before the call.
+          LoadInst *returnedGSR = builder.CreateLoad(interFunctionGSR, "GSR");
+          LoadInst *returnedD = builder.CreateLoad(interFunctionD, "D");
+
+          Instruction *callInst = SAC->getCallSiteForReturnBlock(bi);
+          returnedStateLoads.insert(std::make_pair(callInst, StateLoads(returnedGSR, returnedD)));
+
+          Signature *callSignature = ABS->getSignature(callInst->getParent());
+          Value *returnedSignature = builder.CreateLoad(GSR, "GSR");
+
+          if (indirectTargetTable) {
+            IndirectTargetLookup target = lookUpIndirectTarget(callInst);
+
+            // interFunctionGSR ^ interFunctionD is the signature of the primary return of the
+            // callee, which turns back into the signature of the calling block here.
+            Value *returnAdjustment = builder.CreateXor(target.returnSignature, callSignature);
+            Value *calleeGSR = builder.CreateXor(returnedGSR, returnedD, "GSR");
+            returnedSignature = builder.CreateSelect(target.known,
+                builder.CreateXor(calleeGSR, returnAdjustment, "GSR"), returnedSignature, "GSR");
+          }
+
+          builder.CreateStore(returnedSignature, GSR);
+
+          remainder = insertSignatureUpdate(
+              bi,
+              errorHandlingBlock,
+              GSR,
+              D,
+              ABS->getSignature(bi),
+              callSignature,
+              false, /* adjustForFanin */
+              isCheckedBlock(bi), /* check */
+              &builder);
+
+        } else if (SAC->wasSplitAfterCall(bi)) {
           // Check for a valid control flow transfer from one of the return
           // blocks of the function that was called from the basic block
           // preceding the current one.
-          builder.CreateStore(builder.CreateLoad(interFunctionGSR, "GSR"), GSR);
-          builder.CreateStore(builder.CreateLoad(interFunctionD, "D"), D);
+          LoadInst *returnedGSR = builder.CreateLoad(interFunctionGSR, "GSR");
+          LoadInst *returnedD = builder.CreateLoad(interFunctionD, "D");
+          builder.CreateStore(returnedGSR, GSR);
+          builder.CreateStore(returnedD, D);
+
+          returnedStateLoads.insert(std::make_pair(SAC->getCallSiteForReturnBlock(bi),
+              StateLoads(returnedGSR, returnedD)));
 
           Function *calledFunction = SAC->getCalledFunctionForReturnBlock(bi);
 
           ReturnInst *primaryReturn = II->getPrimaryReturn(calledFunction);
           BasicBlock *authoritativeReturnBlock = primaryReturn->getParent();
           assert(authoritativeReturnBlock);
-          ReturnList *returns = II->getReturns(calledFunction);
-          assert(returns);
+          ReturnList returns = II->getReturns(calledFunction);
 
           remainder = insertSignatureUpdate(
               bi,
@@ -208,7 +432,8 @@ namespace cfcss {
               D,
               ABS->getSignature(bi),
               ABS->getSignature(authoritativeReturnBlock),
-              (returns->size() > 1), /* adjustForFanin */
+              (returns.size() > 1), /* adjustForFanin */
+              isCheckedBlock(bi), /* check */
               &builder);
 
         } else {
@@ -225,6 +450,7 @@ namespace cfcss {
               ABS->getSignature(bi),
               ABS->getSignature(authoritativePredecessor),
               ABS->isFaninNode(bi), /* adjustForFanin */
+              isCheckedBlock(bi), /* check */
               &builder);
         }
 
@@ -237,27 +463,50 @@ namespace cfcss {
 
       DEBUG(errs() << debugPrefix << "Instrumenting call sites.\n");
 
-      CallList *calls = II->getCalls(fi);
-      for (CallList::iterator ci = calls->begin(), ce = calls->end(); ci != ce; ++ci) {
-        CallInst *callInst = *ci;
-        Function *callee = callInst->getCalledFunction();
+      CallList calls = II->getCalls(fi);
+      for (CallList::iterator ci = calls.begin(), ce = calls.end(); ci != ce; ++ci) {
+        Instruction *callInst = *ci;
+        Function *callee = CallSite(callInst).getCalledFunction();
 
         builder.SetInsertPoint(callInst);
-        builder.CreateStore(builder.CreateLoad(GSR, "GSR"), interFunctionGSR);
+        StoreInst *storeGSR = builder.CreateStore(builder.CreateLoad(GSR, "GSR"), interFunctionGSR);
+        StoreInst *storeD = NULL;
 
         if (GF->isFaninNode(callee)) {
           // Set runtime adjusting signature.
           // TODO(hermannloose): Factor out.
           Function *authoritativePredecessor = GF->getAuthoritativePredecessor(callee);
-          CallInst *primaryCall = II->getPrimaryCallTo(callee, authoritativePredecessor);
+          Instruction *primaryCall = II->getPrimaryCallTo(callee, authoritativePredecessor);
 
           Signature *sigA = ABS->getSignature(callInst->getParent());
           Signature *sigB = ABS->getSignature(primaryCall->getParent());
           Signature *signatureAdjustment = Signature::get(getGlobalContext(),
               APIntOps::Xor(sigA->getValue(), sigB->getValue()));
 
-          builder.CreateStore(signatureAdjustment, interFunctionD);
+          storeD = builder.CreateStore(signatureAdjustment, interFunctionD);
         }
+
+        callSiteStores.insert(std::make_pair(callInst, StateStores(storeGSR, storeD)));
+      }
+
+      // Without a table, there's nothing in this module to call indirectly.
+      CallList indirectCalls = indirectTargetTable ? II->getIndirectCalls(fi) : CallList();
+      for (CallList::iterator ci = indirectCalls.begin(), ce = indirectCalls.end(); ci != ce;
+          ++ci) {
+
+        Instruction *callInst = *ci;
+        IndirectTargetLookup target = lookUpIndirectTarget(callInst);
+
+        // Every indirectly called function is a fanin node and adjusts by whatever we store to D,
+        // the looked up signature is 0 for functions we don't know about.
+        Signature *callSignature = ABS->getSignature(callInst->getParent());
+
+        builder.SetInsertPoint(callInst);
+        StoreInst *storeGSR = builder.CreateStore(builder.CreateLoad(GSR, "GSR"), interFunctionGSR);
+        StoreInst *storeD = builder.CreateStore(
+            builder.CreateXor(target.entryAdjustment, callSignature, "D"), interFunctionD);
+
+        callSiteStores.insert(std::make_pair(callInst, StateStores(storeGSR, storeD)));
       }
 
       DEBUG(errs() << debugPrefix << "Instrumenting return blocks.\n");
@@ -274,19 +523,38 @@ namespace cfcss {
           ReturnInst *primaryReturn = II->getPrimaryReturn(fi);
           ConstantInt *sigA = ABS->getSignature(primaryReturn->getParent());
 
-          ReturnList *returns = II->getReturns(fi);
-          for (ReturnList::iterator ri = returns->begin(), re = returns->end(); ri != re; ++ri) {
+          ReturnList returns = II->getReturns(fi);
+          for (ReturnList::iterator ri = returns.begin(), re = returns.end(); ri != re; ++ri) {
             ConstantInt *sigB = ABS->getSignature((*ri)->getParent());
             ConstantInt *signatureAdjustment = ConstantInt::get(getGlobalContext(),
                 APIntOps::Xor(sigA->getValue(), sigB->getValue()));
 
             builder.SetInsertPoint(*ri);
-            builder.CreateStore(builder.CreateLoad(GSR, "GSR"), interFunctionGSR);
-            builder.CreateStore(signatureAdjustment, interFunctionD);
+            StoreInst *storeGSR =
+                builder.CreateStore(builder.CreateLoad(GSR, "GSR"), interFunctionGSR);
+            StoreInst *storeD = builder.CreateStore(signatureAdjustment, interFunctionD);
+
+            returnStores.insert(std::make_pair(*ri, StateStores(storeGSR, storeD)));
           }
         }
       }
 
+      if (SSARegisters || PostInline) {
+        // Promote GSR and D right away instead of relying on mem2reg to run after us. This leaves
+        // no stack slots behind and places phi nodes for GSR and D at fanin nodes.
+        DEBUG(errs() << debugPrefix << "Promoting GSR and D to SSA registers.\n");
+
+        SmallVector<AllocaInst*, 3> registers;
+        registers.push_back(GSR);
+        registers.push_back(D);
+        if (ERR) {
+          registers.push_back(ERR);
+        }
+
+        DominatorTree &DT = getAnalysis<DominatorTree>(*fi);
+        PromoteMemToReg(registers, DT);
+      }
+
       DEBUG(
         errs() << debugPrefix;
         errs().changeColor(raw_ostream::GREEN);
@@ -295,10 +563,67 @@ namespace cfcss {
       );
     }
 
+    defineCheckFunction(checkFunction, false);
+    defineCheckFunction(adjustingCheckFunction, true);
+
+    emitCheckProfile(M);
+
+    if (signatureFaultHandler->use_empty()) {
+      signatureFaultHandler->eraseFromParent();
+      signatureFaultHandler = NULL;
+    } else {
+      defineSignatureFaultHandler();
+    }
+
     return true;
   }
 
 
+  void InstrumentBasicBlocks::releaseMemory() {
+    ignoreBlocks.clear();
+    checkedBlocks.clear();
+    outlinedBlocks.clear();
+    entryLoads.clear();
+    callSiteStores.clear();
+    returnedStateLoads.clear();
+    returnStores.clear();
+    indirectTargetLookups.clear();
+    functionNames.clear();
+    profileEntries.clear();
+    checkProfile.clear();
+  }
+
+
+  GlobalVariable* InstrumentBasicBlocks::getInterFunctionGSR() {
+    return interFunctionGSR;
+  }
+
+
+  GlobalVariable* InstrumentBasicBlocks::getInterFunctionD() {
+    return interFunctionD;
+  }
+
+
+  StateLoads InstrumentBasicBlocks::getEntryLoads(Function * const F) {
+    return entryLoads.lookup(F);
+  }
+
+
+  StateStores InstrumentBasicBlocks::getCallSiteStores(Instruction * const callInst) {
+    return callSiteStores.lookup(callInst);
+  }
+
+
+  StateLoads InstrumentBasicBlocks::getReturnedStateLoads(Instruction * const callInst) {
+    return returnedStateLoads.lookup(callInst);
+  }
+
+
+  StateStores InstrumentBasicBlocks::getReturnStores(ReturnInst * const returnInst) {
+    return returnStores.lookup(returnInst);
+  }
+
+
   BasicBlock* InstrumentBasicBlocks::insertSignatureUpdate(
       BasicBlock *BB,
       BasicBlock *errorHandlingBlock,
@@ -307,28 +632,87 @@ namespace cfcss {
       ConstantInt *signature,
       ConstantInt *predecessorSignature,
       bool adjustForFanin,
+      bool check,
       IRBuilder<> *builder) {
 
     assert(BB);
-    assert(errorHandlingBlock);
+    assert(errorHandlingBlock || faultHook);
     assert(signature);
     assert(predecessorSignature);
     assert(builder);
 
+    insertProfileCounter(BB, ProfileSignatureUpdate, builder);
+
     // Compute the signature update.
     ConstantInt *signatureDiff = ConstantInt::get(getGlobalContext(),
         APIntOps::Xor(signature->getValue(), predecessorSignature->getValue()));
 
     LoadInst *loadGSR = builder->CreateLoad(GSR, "GSR");
+    LoadInst *loadD = adjustForFanin ? builder->CreateLoad(D, "D") : NULL;
+
+    if (check && !ERR && outlinedBlocks.count(BB)) {
+      // Calling the shared check function takes less code than comparing and branching here, and
+      // the block needn't be split either.
+      SmallVector<Value*, 5> arguments;
+      arguments.push_back(loadGSR);
+      if (loadD) {
+        arguments.push_back(loadD);
+      }
+      arguments.push_back(signatureDiff);
+      arguments.push_back(signature);
+      if (faultHook) {
+        arguments.push_back(createFaultSite(BB->getParent()));
+      }
+
+      CallInst *checkedGSR = builder->CreateCall(getCheckFunction(BB->getParent()->getParent(),
+          adjustForFanin), arguments, "GSR");
+      checkedGSR->setCallingConv(CallingConv::Fast);
+
+      builder->CreateStore(checkedGSR, GSR);
+
+      ++NumChecks;
+      ++NumOutlinedChecks;
+
+      return BB;
+    }
+
     Value *signatureUpdate = builder->CreateXor(loadGSR, signatureDiff, "GSR");
 
-    if (adjustForFanin) {
-      LoadInst *loadD = builder->CreateLoad(D, "D");
+    if (loadD) {
       signatureUpdate = builder->CreateXor(signatureUpdate, loadD, "GSR");
     }
 
     builder->CreateStore(signatureUpdate, GSR);
-    Value *compareSignatures = builder->CreateICmpEQ(signatureUpdate, signature, "SIGEQ");
+
+    Value *accumulatedError = NULL;
+    if (ERR) {
+      // Any mismatch leaves bits set in the accumulator until the next check looks at it.
+      Value *mismatch = builder->CreateXor(signatureUpdate, signature, "MISMATCH");
+      accumulatedError = builder->CreateOr(builder->CreateLoad(ERR, "ERR"), mismatch, "ERR");
+    }
+
+    if (!check) {
+      // Any illegal control flow transfer still garbles GSR, which will be caught by the next
+      // check along the way.
+      ++NumUncheckedUpdates;
+
+      if (accumulatedError) {
+        builder->CreateStore(accumulatedError, ERR);
+      }
+
+      return BB;
+    }
+
+    ++NumChecks;
+
+    // Passing a check implies that the accumulator is still zero, so it needn't be stored.
+    Value *compareSignatures = NULL;
+    if (accumulatedError) {
+      compareSignatures = builder->CreateICmpEQ(
+          accumulatedError, ConstantInt::get(accumulatedError->getType(), 0), "SIGEQ");
+    } else {
+      compareSignatures = builder->CreateICmpEQ(signatureUpdate, signature, "SIGEQ");
+    }
 
     // We branch after the comparison, so we split the block there.
     BasicBlock *oldTerminatorBlock = SplitBlock(BB, builder->GetInsertPoint(), this);
@@ -339,13 +723,156 @@ namespace cfcss {
     BB->getTerminator()->eraseFromParent();
     builder->SetInsertPoint(BB);
 
-    BranchInst *errorHandling =
-        builder->CreateCondBr(compareSignatures, oldTerminatorBlock, errorHandlingBlock);
+    if (faultHook) {
+      // Deferred checks may fail on a correct signature update after an earlier one went wrong,
+      // so they report the accumulated error instead of GSR.
+      errorHandlingBlock = createFaultHookBlock(BB, oldTerminatorBlock, GSR,
+          accumulatedError ? accumulatedError : signatureUpdate, signature);
+    }
+
+    BranchInst *errorHandling = builder->CreateCondBr(
+        compareSignatures, oldTerminatorBlock, errorHandlingBlock, checkWeights);
 
     return oldTerminatorBlock;
   }
 
 
+  void InstrumentBasicBlocks::createIndirectTargetTable(Module &M) {
+    IntegerType *intType = ABS->getSignatureType();
+    IntegerType *int8Type = Type::getInt8Ty(getGlobalContext());
+    IntegerType *int32Type = Type::getInt32Ty(getGlobalContext());
+
+    std::vector<Type*> fields;
+    fields.push_back(int8Type); // jmp rel8
+    fields.push_back(int8Type); // rel8
+    fields.push_back(int32Type); // magic
+    fields.push_back(int32Type); // table index
+    fields.push_back(intType); // signature of the authoritative call site
+    fields.push_back(intType); // signature of the primary return
+    indirectTargetHeaderType = StructType::get(getGlobalContext(), fields, true /* isPacked */);
+
+    // The header has to jump over itself, prefix data precedes the first instruction of the
+    // function but is entered through its symbol.
+    uint64_t headerSize = getIndirectTargetHeaderSize(intType);
+    assert(headerSize - 2 < 128 && "Header should be short enough for a short jump!");
+
+    // Headers of other modules, which index into a different table, carry a different magic
+    // number.
+    uint64_t hash = ABS->getModuleHash();
+    uint32_t magic = static_cast<uint32_t>(hash ^ (hash >> 32));
+    indirectTargetMagic = magic ? magic : 1;
+
+    ArrayRef<Function*> gateways = GF->getIndirectTargets();
+    PointerType *int8PtrType = Type::getInt8PtrTy(getGlobalContext());
+    std::vector<Constant*> table;
+
+    for (unsigned int idx = 0; idx < gateways.size(); ++idx) {
+      Function *gateway = gateways[idx];
+      Function *internal = GF->getInternalFunction(gateway);
+
+      Function *authoritativePredecessor = GF->getAuthoritativePredecessor(internal);
+      Instruction *primaryCall = II->getPrimaryCallTo(internal, authoritativePredecessor);
+      assert(primaryCall && "Function should have an authoritative call site!");
+
+      Constant *returnSignature = ConstantInt::get(intType, 0);
+      if (!II->doesNotReturn(internal)) {
+        returnSignature = ABS->getSignature(II->getPrimaryReturn(internal)->getParent());
+      }
+
+      std::vector<Constant*> header;
+      header.push_back(ConstantInt::get(int8Type, 0xEB));
+      header.push_back(ConstantInt::get(int8Type, headerSize - 2));
+      header.push_back(ConstantInt::get(int32Type, indirectTargetMagic));
+      header.push_back(ConstantInt::get(int32Type, idx));
+      header.push_back(ABS->getSignature(primaryCall->getParent()));
+      header.push_back(returnSignature);
+
+      gateway->setPrefixData(ConstantStruct::get(indirectTargetHeaderType, header));
+      table.push_back(ConstantExpr::getBitCast(internal, int8PtrType));
+    }
+
+    ArrayType *tableType = ArrayType::get(int8PtrType, table.size());
+    indirectTargetTable = new GlobalVariable(
+        M,
+        tableType,
+        true, /* isConstant */
+        GlobalValue::InternalLinkage,
+        ConstantArray::get(tableType, table),
+        "cfcss.indirectTargets");
+
+    // Looked up instead of the header of functions that we don't know about, so that the lookup
+    // needn't branch.
+    unknownIndirectTarget = new GlobalVariable(
+        M,
+        indirectTargetHeaderType,
+        true, /* isConstant */
+        GlobalValue::InternalLinkage,
+        Constant::getNullValue(indirectTargetHeaderType),
+        "cfcss.unknownIndirectTarget");
+
+    DEBUG(errs() << debugPrefix << "Created table of " << table.size() << " indirect targets.\n");
+  }
+
+
+  IndirectTargetLookup InstrumentBasicBlocks::lookUpIndirectTarget(Instruction *callInst) {
+    std::pair<DenseMap<Instruction*, IndirectTargetLookup>::iterator, bool> cached =
+        indirectTargetLookups.insert(std::make_pair(callInst, IndirectTargetLookup()));
+
+    IndirectTargetLookup &lookup = cached.first->second;
+    if (!cached.second) {
+      return lookup;
+    }
+
+    IRBuilder<> builder(callInst);
+
+    Type *int16PtrType = Type::getInt16PtrTy(getGlobalContext());
+    Type *int32PtrType = Type::getInt32PtrTy(getGlobalContext());
+    Type *int8PtrType = Type::getInt8PtrTy(getGlobalContext());
+
+    // This assumes that the first few bytes of any function may be read, which holds as long as
+    // functions live in readable code.
+    CallSite callSite(callInst);
+    Value *target = callSite.getCalledValue();
+    Value *targetBytes = builder.CreateBitCast(target, int8PtrType);
+
+    uint64_t headerSize = getIndirectTargetHeaderSize(ABS->getSignatureType());
+    LoadInst *jump = builder.CreateLoad(builder.CreateBitCast(targetBytes, int16PtrType));
+    jump->setAlignment(1);
+    LoadInst *magic = builder.CreateLoad(
+        builder.CreateBitCast(builder.CreateConstGEP1_32(targetBytes, 2), int32PtrType));
+    magic->setAlignment(1);
+
+    Value *known = builder.CreateAnd(
+        builder.CreateICmpEQ(jump, builder.getInt16(0xEB | (headerSize - 2) << 8)),
+        builder.CreateICmpEQ(magic, builder.getInt32(indirectTargetMagic)),
+        "KNOWN");
+
+    Value *header = builder.CreateSelect(known, targetBytes,
+        ConstantExpr::getBitCast(unknownIndirectTarget, int8PtrType));
+    header = builder.CreateBitCast(header, indirectTargetHeaderType->getPointerTo());
+
+    LoadInst *index = builder.CreateLoad(builder.CreateStructGEP(header, 3));
+    index->setAlignment(1);
+    LoadInst *entryAdjustment = builder.CreateLoad(builder.CreateStructGEP(header, 4));
+    entryAdjustment->setAlignment(1);
+    LoadInst *returnSignature = builder.CreateLoad(builder.CreateStructGEP(header, 5));
+    returnSignature->setAlignment(1);
+
+    Value *indices[] = { builder.getInt32(0), index };
+    Value *internal = builder.CreateLoad(builder.CreateInBoundsGEP(indirectTargetTable, indices));
+    callSite.setCalledFunction(builder.CreateSelect(known,
+        builder.CreateBitCast(internal, target->getType()), target));
+
+    lookup.known = known;
+    lookup.entryAdjustment = entryAdjustment;
+    lookup.returnSignature = returnSignature;
+
+    ++NumIndirectCalls;
+
+    return lookup;
+  }
+
+
   Instruction* InstrumentBasicBlocks::insertRuntimeAdjustingSignature(BasicBlock &BB, Value *D,
       IRBuilder<> *builder) {
     // If this is actually our block, we do want to store 0 in D, so
@@ -357,11 +884,302 @@ namespace cfcss {
     Signature *signatureAdjustment = ConstantInt::get(getGlobalContext(),
         APIntOps::Xor(signature->getValue(), siblingSignature->getValue()));
 
+    insertProfileCounter(&BB, ProfileRuntimeAdjustingSignature, builder);
+
     return builder->CreateStore(signatureAdjustment, D);
   }
 
 
+  void InstrumentBasicBlocks::selectCheckedBlocks(Function *F) {
+    checkedBlocks.clear();
+    checkAllBlocks = CheckPolicy.empty() && !CheckInterval && !DeferredChecks;
+
+    bool checkStores = false;
+    bool checkCalls = false;
+    bool checkReturns = false;
+    bool checkBackEdges = false;
+
+    for (unsigned int idx = 0; idx < CheckPolicy.size(); ++idx) {
+      switch (CheckPolicy[idx]) {
+        case CheckEveryBlock: checkAllBlocks = true; break;
+        case CheckBeforeStores: checkStores = true; break;
+        case CheckBeforeCalls: checkCalls = true; break;
+        case CheckBeforeReturns: checkReturns = true; break;
+        case CheckBackEdges: checkBackEdges = true; break;
+      }
+    }
+
+    if (checkAllBlocks) {
+      return;
+    }
+
+    if (DeferredChecks && CheckPolicy.empty()) {
+      checkCalls = true;
+      checkReturns = true;
+      checkBackEdges = true;
+    }
+
+    selectCheckPoints(F, checkStores, checkCalls, checkReturns, checkBackEdges);
+
+    // Only region heads check signatures, so they have to check on behalf of their whole region.
+    BlockSet checkPoints(checkedBlocks);
+    checkedBlocks.clear();
+    for (BlockSet::iterator bi = checkPoints.begin(), be = checkPoints.end(); bi != be; ++bi) {
+      checkedBlocks.insert(SR->getRegionHead(*bi));
+    }
+  }
+
+
+  void InstrumentBasicBlocks::selectCheckPoints(Function *F, bool checkStores, bool checkCalls,
+      bool checkReturns, bool checkBackEdges) {
+
+    for (Function::iterator bi = F->begin(), be = F->end(); bi != be; ++bi) {
+      TerminatorInst *terminator = bi->getTerminator();
+
+      // A gateway resets GSR once it returns, so anything that went wrong has to be caught on
+      // the way out.
+      if (isa<ReturnInst>(terminator) && (checkReturns || GF->isGateway(F))) {
+        checkedBlocks.insert(bi);
+        continue;
+      }
+
+      for (BasicBlock::iterator ii = bi->begin(), ie = bi->end(); ii != ie; ++ii) {
+        if (checkStores && (isa<StoreInst>(ii) || isa<AtomicRMWInst>(ii)
+            || isa<AtomicCmpXchgInst>(ii))) {
+
+          checkedBlocks.insert(bi);
+          break;
+        }
+
+        if (checkCalls && (isa<CallInst>(ii) || isa<InvokeInst>(ii)) && !isa<IntrinsicInst>(ii)) {
+          checkedBlocks.insert(bi);
+          break;
+        }
+      }
+    }
+
+    if (!checkBackEdges && !CheckInterval) {
+      return;
+    }
+
+    SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 32> backEdges;
+    FindFunctionBackedges(*F, backEdges);
+
+    BlockSet loopHeaders;
+    for (unsigned int idx = 0; idx < backEdges.size(); ++idx) {
+      if (checkBackEdges) {
+        checkedBlocks.insert(const_cast<BasicBlock*>(backEdges[idx].first));
+      }
+      loopHeaders.insert(const_cast<BasicBlock*>(backEdges[idx].second));
+    }
+
+    if (!CheckInterval) {
+      return;
+    }
+
+    // Count the longest run of unchecked blocks leading up to each block along forward edges and
+    // check wherever it would reach the interval. Checking all loop headers keeps cycles from
+    // accumulating an unbounded number of unchecked blocks.
+    DenseMap<BasicBlock*, unsigned> uncheckedRun;
+    ReversePostOrderTraversal<Function*> RPOT(F);
+    for (ReversePostOrderTraversal<Function*>::rpo_iterator bi = RPOT.begin(), be = RPOT.end();
+        bi != be; ++bi) {
+
+      BasicBlock *BB = *bi;
+
+      if (checkedBlocks.count(BB) || loopHeaders.count(BB)) {
+        checkedBlocks.insert(BB);
+        uncheckedRun[BB] = 0;
+        continue;
+      }
+
+      unsigned run = 0;
+      for (pred_iterator pi = pred_begin(BB), pe = pred_end(BB); pi != pe; ++pi) {
+        // Predecessors not visited yet are on back-edges and end in a checked loop header.
+        run = std::max(run, uncheckedRun.lookup(*pi));
+      }
+
+      if (++run >= CheckInterval) {
+        checkedBlocks.insert(BB);
+        run = 0;
+      }
+
+      uncheckedRun[BB] = run;
+    }
+  }
+
+
+  bool InstrumentBasicBlocks::isCheckedBlock(BasicBlock * const BB) {
+    return checkAllBlocks || checkedBlocks.count(BB);
+  }
+
+
+  void InstrumentBasicBlocks::selectOutlinedBlocks(Function *F) {
+    outlinedBlocks.clear();
+
+    // Deferred checks don't branch in every block to begin with.
+    if (!OutlineColdChecks || DeferredChecks) {
+      return;
+    }
+
+    AttributeSet attributes = F->getAttributes();
+    bool optimizeForSize =
+        attributes.hasAttribute(AttributeSet::FunctionIndex, Attribute::Cold)
+        || attributes.hasAttribute(AttributeSet::FunctionIndex, Attribute::OptimizeForSize)
+        || attributes.hasAttribute(AttributeSet::FunctionIndex, Attribute::MinSize);
+
+    // Measured counts beat estimated frequencies, if we have them for this function and they were
+    // counted with the signatures it has now.
+    StringMap<FunctionProfile>::iterator profile = checkProfile.find(F->getName());
+    DenseMap<uint64_t, uint64_t> *counts = NULL;
+    if (profile != checkProfile.end()) {
+      if (profile->second.fingerprint == signatureFingerprint) {
+        counts = &profile->second.counts;
+      } else {
+        errs() << "CFCSS: warning: check profile " << CheckProfile << " is stale for ["
+            << F->getName() << "], using estimated frequencies instead.\n";
+      }
+    }
+
+    BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>(*F);
+    uint64_t entryFrequency = counts
+        ? counts->lookup(ABS->getSignature(&F->getEntryBlock())->getZExtValue())
+        : BFI.getBlockFreq(&F->getEntryBlock()).getFrequency();
+
+    // Nothing in a function that never ran while profiling is worth checking inline.
+    bool neverEntered = counts && !entryFrequency;
+
+    // Only region heads check, on behalf of their whole region.
+    uint64_t checkedFrequency = 0;
+    uint64_t outlinedFrequency = 0;
+    unsigned int numCheckedBlocks = 0;
+
+    for (Function::iterator bi = F->begin(), be = F->end(); bi != be; ++bi) {
+      if (!SR->isRegionHead(bi) || !isCheckedBlock(bi)) {
+        continue;
+      }
+
+      uint64_t frequency = counts
+          ? counts->lookup(ABS->getSignature(bi)->getZExtValue())
+          : BFI.getBlockFreq(bi).getFrequency();
+      checkedFrequency += frequency;
+      ++numCheckedBlocks;
+
+      if (optimizeForSize || neverEntered || frequency * ColdBlockRatio < entryFrequency) {
+        outlinedBlocks.insert(bi);
+        outlinedFrequency += frequency;
+      }
+    }
+
+    DEBUG(errs() << debugPrefix << "Outlining " << outlinedBlocks.size() << " of "
+        << numCheckedBlocks << " checks in [" << F->getName() << "], "
+        << (checkedFrequency ? outlinedFrequency * 100 / checkedFrequency : 0)
+        << "% of their estimated executions.\n");
+  }
+
+
+  Function* InstrumentBasicBlocks::getCheckFunction(Module *M, bool adjustForFanin) {
+    Function *&F = adjustForFanin ? adjustingCheckFunction : checkFunction;
+
+    if (!F) {
+      Type *intType = ABS->getSignatureType();
+
+      // GSR, D if adjusting, the signature difference, the expected signature and the fault site
+      // of the caller if reporting to the fault hook.
+      SmallVector<Type*, 5> parameters(adjustForFanin ? 4 : 3, intType);
+      if (faultHook) {
+        parameters.push_back(faultSiteType->getPointerTo());
+      }
+
+      // Only declare it for now, so that we don't try to instrument it.
+      F = Function::Create(FunctionType::get(intType, parameters, false),
+          GlobalValue::InternalLinkage,
+          adjustForFanin ? "cfcss.checkAdjustedSignature" : "cfcss.checkSignature",
+          M);
+      F->setCallingConv(CallingConv::Fast);
+    }
+
+    return F;
+  }
+
+
+  void InstrumentBasicBlocks::defineCheckFunction(Function *F, bool adjustForFanin) {
+    if (!F) {
+      return;
+    }
+
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::NoUnwind);
+    F->addFnAttr(Attribute::OptimizeForSize);
+
+    Function::arg_iterator ai = F->arg_begin();
+    Value *GSR = ai++;
+    Value *D = adjustForFanin ? ai++ : NULL;
+    Value *signatureDiff = ai++;
+    Value *signature = ai++;
+    Value *faultSite = faultHook ? ai++ : NULL;
+
+    BasicBlock *entry = BasicBlock::Create(getGlobalContext(), "entry", F);
+    BasicBlock *passed = BasicBlock::Create(getGlobalContext(), "passed", F);
+    BasicBlock *errorHandlingBlock = BasicBlock::Create(getGlobalContext(),
+        "handleSignatureFault", F);
+
+    IRBuilder<> builder(entry);
+
+    Value *signatureUpdate = builder.CreateXor(GSR, signatureDiff, "GSR");
+    if (D) {
+      signatureUpdate = builder.CreateXor(signatureUpdate, D, "GSR");
+    }
+
+    Value *compareSignatures = builder.CreateICmpEQ(signatureUpdate, signature, "SIGEQ");
+    builder.CreateCondBr(compareSignatures, passed, errorHandlingBlock, checkWeights);
+
+    builder.SetInsertPoint(passed);
+    builder.CreateRet(signatureUpdate);
+
+    builder.SetInsertPoint(errorHandlingBlock);
+
+    if (faultHook) {
+      Type *int64Type = builder.getInt64Ty();
+      builder.CreateCall3(faultHook, faultSite,
+          builder.CreateZExtOrBitCast(signature, int64Type),
+          builder.CreateZExtOrBitCast(signatureUpdate, int64Type));
+      builder.CreateRet(signature);
+    } else {
+      CallInst *handlerCall = builder.CreateCall(signatureFaultHandler);
+      handlerCall->setDoesNotReturn();
+      builder.CreateUnreachable();
+    }
+
+    DEBUG(errs() << debugPrefix << "Defined [" << F->getName() << "].\n");
+  }
+
+
+  void InstrumentBasicBlocks::defineSignatureFaultHandler() {
+    Function *F = signatureFaultHandler;
+
+    F->addFnAttr(Attribute::Cold);
+    F->addFnAttr(Attribute::NoInline);
+    F->addFnAttr(Attribute::NoReturn);
+    F->addFnAttr(Attribute::NoUnwind);
+    F->setSection(".text.unlikely");
+
+    BasicBlock *entry = BasicBlock::Create(getGlobalContext(), "entry", F);
+    IRBuilder<> builder(entry);
+
+    InlineAsm *ud2 =
+        InlineAsm::get(FunctionType::get(builder.getVoidTy(), ArrayRef<Type*>(), false),
+            StringRef("ud2"), StringRef(), true);
+
+    builder.CreateCall(ud2);
+    builder.CreateUnreachable();
+
+    DEBUG(errs() << debugPrefix << "Defined signature fault handler.\n");
+  }
+
+
   BasicBlock* InstrumentBasicBlocks::createErrorHandlingBlock(Function *F) {
+    // Branches need a target within the function, which only calls the shared handler.
     BasicBlock *errorHandlingBlock = BasicBlock::Create(
         getGlobalContext(),
         "handleSignatureFault",
@@ -369,11 +1187,9 @@ namespace cfcss {
 
     IRBuilder<> builder(errorHandlingBlock);
 
-    InlineAsm *ud2 =
-        InlineAsm::get(FunctionType::get(builder.getVoidTy(), ArrayRef<Type*>(), false),
-            StringRef("ud2"), StringRef(), true);
-
-    builder.CreateCall(ud2);
+    CallInst *handlerCall = builder.CreateCall(signatureFaultHandler);
+    handlerCall->setDoesNotReturn();
+    handlerCall->setDoesNotThrow();
     builder.CreateUnreachable();
 
     ignoreBlocks.insert(errorHandlingBlock);
@@ -384,6 +1200,260 @@ namespace cfcss {
   }
 
 
+  BasicBlock* InstrumentBasicBlocks::createFaultHookBlock(BasicBlock *BB, BasicBlock *continuation,
+      Value *GSR, Value *observed, Signature *signature) {
+
+    Function *F = BB->getParent();
+    BasicBlock *faultBlock = BasicBlock::Create(getGlobalContext(), "handleSignatureFault", F);
+
+    IRBuilder<> builder(faultBlock);
+
+    Type *int64Type = builder.getInt64Ty();
+    builder.CreateCall3(faultHook, createFaultSite(F),
+        builder.CreateZExtOrBitCast(signature, int64Type),
+        builder.CreateZExtOrBitCast(observed, int64Type));
+
+    // If the hook returns, pretend the check passed, so that the fault isn't reported again by
+    // every check downstream.
+    builder.CreateStore(signature, GSR);
+    if (ERR) {
+      builder.CreateStore(ConstantInt::get(signature->getType(), 0), ERR);
+    }
+
+    builder.CreateBr(continuation);
+
+    ignoreBlocks.insert(faultBlock);
+
+    return faultBlock;
+  }
+
+
+  Constant* InstrumentBasicBlocks::createFaultSite(Function *F) {
+    Type *int8PtrType = Type::getInt8PtrTy(getGlobalContext());
+
+    Constant *fields[] = {
+      getFunctionName(F),
+      ConstantInt::get(Type::getInt32Ty(getGlobalContext()), numFaultSites++),
+      ConstantInt::get(Type::getInt64Ty(getGlobalContext()), 0),
+      Constant::getNullValue(int8PtrType)
+    };
+
+    ++NumFaultSites;
+
+    // Written to by the runtime.
+    return new GlobalVariable(
+        *F->getParent(),
+        faultSiteType,
+        false, /* isConstant */
+        GlobalValue::InternalLinkage,
+        ConstantStruct::get(faultSiteType, fields),
+        "cfcss.faultSite");
+  }
+
+
+  Constant* InstrumentBasicBlocks::getFunctionName(Function *F) {
+    Constant *&name = functionNames[F];
+
+    if (!name) {
+      Constant *string = ConstantDataArray::getString(getGlobalContext(), F->getName());
+      GlobalVariable *global = new GlobalVariable(*F->getParent(), string->getType(),
+          true /* isConstant */, GlobalValue::PrivateLinkage, string, "cfcss.functionName");
+      global->setUnnamedAddr(true);
+      name = ConstantExpr::getBitCast(global, Type::getInt8PtrTy(getGlobalContext()));
+    }
+
+    return name;
+  }
+
+
+  void InstrumentBasicBlocks::insertProfileCounter(BasicBlock *BB, ProfileKind kind,
+      IRBuilder<> *builder) {
+
+    if (!profileCounters) {
+      return;
+    }
+
+    Type *int64Type = builder->getInt64Ty();
+
+    Constant *entry[] = {
+      getFunctionName(BB->getParent()),
+      builder->getInt64(signatureFingerprint),
+      builder->getInt32(kind),
+      ConstantExpr::getZExtOrBitCast(ABS->getSignature(BB), int64Type)
+    };
+    profileEntries.push_back(ConstantStruct::getAnon(entry));
+
+    // Not atomic, like gcov counters, as losing the odd increment to a race doesn't matter here.
+    Value *counter = builder->CreateConstGEP1_32(profileCounters, profileEntries.size() - 1);
+    LoadInst *count = builder->CreateLoad(counter, "count");
+    builder->CreateStore(builder->CreateAdd(count, ConstantInt::get(int64Type, 1), "count"),
+        counter);
+
+    ++NumProfileCounters;
+  }
+
+
+  void InstrumentBasicBlocks::emitCheckProfile(Module &M) {
+    if (!profileCounters) {
+      return;
+    }
+
+    if (profileEntries.empty()) {
+      profileCounters->eraseFromParent();
+      profileCounters = NULL;
+      return;
+    }
+
+    LLVMContext &context = getGlobalContext();
+    Type *int8PtrType = Type::getInt8PtrTy(context);
+    Type *int32Type = Type::getInt32Ty(context);
+    Type *int64Type = Type::getInt64Ty(context);
+
+    ArrayType *countersType = ArrayType::get(int64Type, profileEntries.size());
+    GlobalVariable *counters = new GlobalVariable(
+        M,
+        countersType,
+        false, /* isConstant */
+        GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(countersType),
+        "cfcss.checkCounters");
+
+    profileCounters->replaceAllUsesWith(
+        ConstantExpr::getBitCast(counters, profileCounters->getType()));
+    counters->takeName(profileCounters);
+    profileCounters->eraseFromParent();
+    profileCounters = NULL;
+
+    // Function name, signature fingerprint, kind and signature, as struct cfcss_profile_entry in
+    // CFCSSRuntime.h.
+    ArrayType *entriesType = ArrayType::get(profileEntries.front()->getType(),
+        profileEntries.size());
+    GlobalVariable *entries = new GlobalVariable(
+        M,
+        entriesType,
+        true, /* isConstant */
+        GlobalValue::InternalLinkage,
+        ConstantArray::get(entriesType, profileEntries),
+        "cfcss.checkProfileEntries");
+
+    Constant *moduleName = ConstantDataArray::getString(context, M.getModuleIdentifier());
+    GlobalVariable *moduleNameGlobal = new GlobalVariable(M, moduleName->getType(),
+        true /* isConstant */, GlobalValue::PrivateLinkage, moduleName, "cfcss.moduleName");
+
+    // Module name, number of counters, counters, entries and the runtime's list link, as struct
+    // cfcss_profile in CFCSSRuntime.h.
+    Constant *fields[] = {
+      ConstantExpr::getBitCast(moduleNameGlobal, int8PtrType),
+      ConstantInt::get(int32Type, profileEntries.size()),
+      ConstantExpr::getBitCast(counters, int64Type->getPointerTo()),
+      ConstantExpr::getBitCast(entries, int8PtrType),
+      Constant::getNullValue(int8PtrType)
+    };
+
+    Constant *descriptor = ConstantStruct::getAnon(fields);
+    GlobalVariable *profile = new GlobalVariable(
+        M,
+        descriptor->getType(),
+        false, /* isConstant */
+        GlobalValue::InternalLinkage,
+        descriptor,
+        "cfcss.checkProfile");
+
+    Constant *registerProfile = M.getOrInsertFunction("cfcss_register_profile",
+        Type::getVoidTy(context), profile->getType(), NULL);
+
+    Function *constructor = Function::Create(
+        FunctionType::get(Type::getVoidTy(context), false),
+        GlobalValue::InternalLinkage,
+        "cfcss.registerProfile",
+        &M);
+
+    IRBuilder<> builder(BasicBlock::Create(context, "entry", constructor));
+    builder.CreateCall(registerProfile, profile);
+    builder.CreateRetVoid();
+
+    appendToGlobalCtors(M, constructor, 65535);
+
+    DEBUG(errs() << debugPrefix << "Emitted " << profileEntries.size() << " check counters.\n");
+  }
+
+
+  void InstrumentBasicBlocks::readCheckProfile(Module &M) {
+    OwningPtr<MemoryBuffer> buffer;
+    if (error_code error = MemoryBuffer::getFile(CheckProfile, buffer)) {
+      report_fatal_error(Twine("CFCSS: could not read check profile ") + CheckProfile + ": "
+          + error.message());
+    }
+
+    // One counter per line, as "<function> <fingerprint> <kind> <signature> <count>", where the
+    // kind is "update" or "adjust", following a "module <identifier>" line for the module that
+    // the function belongs to. Lines starting with '#' are comments. Counts for the same counter,
+    // e.g. from several runs, add up. Functions that have the same name in other modules, e.g.
+    // static ones, are of no concern here.
+    SmallVector<StringRef, 256> lines;
+    buffer->getBuffer().split(lines, "\n", -1, false);
+
+    bool inModule = false;
+
+    for (unsigned int idx = 0; idx < lines.size(); ++idx) {
+      StringRef line = lines[idx].trim();
+      if (line.empty() || line.startswith("#")) {
+        continue;
+      }
+
+      if (line.startswith("module ")) {
+        inModule = line.split(' ').second == M.getModuleIdentifier();
+        continue;
+      }
+
+      SmallVector<StringRef, 5> fields;
+      line.split(fields, " ", -1, false);
+
+      uint64_t fingerprint = 0;
+      uint64_t signature = 0;
+      uint64_t count = 0;
+      if (fields.size() != 5 || fields[1].getAsInteger(0, fingerprint)
+          || fields[3].getAsInteger(0, signature) || fields[4].getAsInteger(10, count)) {
+
+        report_fatal_error(Twine("CFCSS: malformed line in check profile ") + CheckProfile + ": "
+            + line);
+      }
+
+      if (!inModule) {
+        continue;
+      }
+
+      bool seen = checkProfile.count(fields[0]);
+      FunctionProfile &profile = checkProfile[fields[0]];
+      if (!seen) {
+        profile.fingerprint = fingerprint;
+      } else if (profile.fingerprint != fingerprint) {
+        // Counted with different signatures in different runs, and matching neither for sure.
+        profile.fingerprint = 0;
+      }
+
+      if (fields[2] == "update") {
+        profile.counts[signature] += count;
+      }
+    }
+
+    DEBUG(errs() << debugPrefix << "Read check profile for " << checkProfile.size()
+        << " functions.\n");
+  }
+
+
+  uint64_t InstrumentBasicBlocks::getSignatureFingerprint(Function *F) {
+    SmallVector<uint64_t, 64> values;
+    for (Function::iterator bi = F->begin(), be = F->end(); bi != be; ++bi) {
+      values.push_back(ABS->getSignature(bi)->getZExtValue());
+      values.push_back(bi->size());
+    }
+
+    return hashName(StringRef(reinterpret_cast<const char*>(values.data()),
+        values.size() * sizeof(uint64_t)));
+  }
+
+
   char InstrumentBasicBlocks::ID = 0;
 }
 
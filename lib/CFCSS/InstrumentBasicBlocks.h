@@ -4,16 +4,86 @@
 #include "AssignBlockSignatures.h"
 #include "GatewayFunctions.h"
 #include "InstructionIndex.h"
+#include "SignatureRegions.h"
 #include "SplitAfterCall.h"
 
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
+#include <vector>
+
 namespace cfcss {
 
+  /**
+   * Loads of interFunctionGSR and interFunctionD, in that order.
+   */
+  typedef std::pair<llvm::LoadInst*, llvm::LoadInst*> StateLoads;
+
+  /**
+   * Stores to interFunctionGSR and interFunctionD, in that order. The latter may be NULL.
+   */
+  typedef std::pair<llvm::StoreInst*, llvm::StoreInst*> StateStores;
+
+  /**
+   * Values looked up from the prefix data of an indirectly called function, right before the
+   * call.
+   */
+  struct IndirectTargetLookup {
+    IndirectTargetLookup() : known(NULL), entryAdjustment(NULL), returnSignature(NULL) {}
+
+    /**
+     * Whether the target is a gateway from this module, otherwise the call goes to the target as
+     * before and the other values are 0.
+     */
+    llvm::Value *known;
+
+    /**
+     * The signature that the callee expects its caller to have, i.e. that of its authoritative
+     * call site.
+     */
+    llvm::Value *entryAdjustment;
+
+    /**
+     * The signature of the block holding the primary return of the callee.
+     */
+    llvm::Value *returnSignature;
+  };
+
+  /**
+   * What a counter counts with -cfcss-profile-checks, which has to match enum cfcss_profile_kind in
+   * CFCSSRuntime.h.
+   */
+  enum ProfileKind {
+    ProfileSignatureUpdate,
+    ProfileRuntimeAdjustingSignature
+  };
+
+  /**
+   * Counts of signature updates in a function read from -cfcss-check-profile, by signature, and
+   * the fingerprint of the signatures that they were counted with.
+   */
+  struct FunctionProfile {
+    FunctionProfile() : fingerprint(0), counts() {}
+
+    uint64_t fingerprint;
+    llvm::DenseMap<uint64_t, uint64_t> counts;
+  };
+
+  /**
+   * Kinds of basic blocks that may be selected for signature checks with -cfcss-check-policy.
+   */
+  enum CheckPoint {
+    CheckEveryBlock,
+    CheckBeforeStores,
+    CheckBeforeCalls,
+    CheckBeforeReturns,
+    CheckBackEdges
+  };
+
   /**
    * Instrument all basic blocks in a module with signature checks.
    *
@@ -29,17 +99,139 @@ namespace cfcss {
 
       virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
       virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
+
+      llvm::GlobalVariable* getInterFunctionGSR();
+      llvm::GlobalVariable* getInterFunctionD();
+
+      /**
+       * Get the loads through which the given function picks up GSR and D from its caller.
+       */
+      StateLoads getEntryLoads(llvm::Function * const F);
+
+      /**
+       * Get the stores through which the given call or invoke hands GSR and D to the called
+       * function.
+       */
+      StateStores getCallSiteStores(llvm::Instruction * const callInst);
+
+      /**
+       * Get the loads through which GSR and D are picked up again after the given call or invoke
+       * returns normally.
+       */
+      StateLoads getReturnedStateLoads(llvm::Instruction * const callInst);
+
+      /**
+       * Get the stores through which the given return instruction hands GSR and D back to the
+       * caller.
+       */
+      StateStores getReturnStores(llvm::ReturnInst * const returnInst);
 
     private:
       AssignBlockSignatures *ABS;
       GatewayFunctions *GF;
       InstructionIndex *II;
       SplitAfterCall *SAC;
+      SignatureRegions *SR;
 
       BlockSet ignoreBlocks;
 
+      /**
+       * The error accumulator of the function being instrumented, if checks are deferred.
+       */
+      llvm::AllocaInst *ERR;
+
+      bool checkAllBlocks;
+      BlockSet checkedBlocks;
+
+      /**
+       * Select the basic blocks of the given function that compare GSR against their signature,
+       * according to -cfcss-check-policy and -cfcss-check-interval.
+       */
+      void selectCheckedBlocks(llvm::Function *F);
+      void selectCheckPoints(llvm::Function *F, bool checkStores, bool checkCalls,
+          bool checkReturns, bool checkBackEdges);
+
+      bool isCheckedBlock(llvm::BasicBlock * const BB);
+
+      BlockSet outlinedBlocks;
+
+      /**
+       * Select the checked basic blocks of the given function that call a shared check function
+       * instead of checking inline, according to -cfcss-outline-cold-checks.
+       */
+      void selectOutlinedBlocks(llvm::Function *F);
+
+      /**
+       * Get the shared function that updates GSR, checks it against the expected signature and
+       * returns it, declaring it on first use. With -cfcss-fault-hook, it also takes the fault
+       * site of the calling check.
+       */
+      llvm::Function* getCheckFunction(llvm::Module *M, bool adjustForFanin);
+
+      /**
+       * Fill in the body of a shared check function, if it has been used at all.
+       */
+      void defineCheckFunction(llvm::Function *F, bool adjustForFanin);
+
+      /**
+       * Fill in the body of the module-wide, cold and out-of-line signature fault handler.
+       */
+      void defineSignatureFaultHandler();
+
+      /**
+       * Create the block in the given function that signature checks branch to upon failure, which
+       * calls the shared signature fault handler.
+       */
       llvm::BasicBlock* createErrorHandlingBlock(llvm::Function *F);
 
+      /**
+       * Create a block for a single signature check to branch to upon failure with
+       * -cfcss-fault-hook, which reports the fault and carries on at the given block with the
+       * expected signature in GSR.
+       */
+      llvm::BasicBlock* createFaultHookBlock(
+          llvm::BasicBlock *BB,
+          llvm::BasicBlock *continuation,
+          llvm::Value *GSR,
+          llvm::Value *observed,
+          Signature *signature);
+
+      /**
+       * Create the descriptor that identifies a check in the given function to the fault hook.
+       */
+      llvm::Constant* createFaultSite(llvm::Function *F);
+
+      /**
+       * Get a string constant holding the name of the given function.
+       */
+      llvm::Constant* getFunctionName(llvm::Function *F);
+
+      /**
+       * Count executions of the signature update or runtime adjusting signature of the given
+       * basic block at the insertion point of the builder, with -cfcss-profile-checks.
+       */
+      void insertProfileCounter(llvm::BasicBlock *BB, ProfileKind kind,
+          llvm::IRBuilder<> *builder);
+
+      /**
+       * Create the counter array and the table describing its entries, and register both with the
+       * runtime from a constructor, if any counters were inserted.
+       */
+      void emitCheckProfile(llvm::Module &M);
+
+      /**
+       * Read the counts of signature updates in the given module from -cfcss-check-profile into
+       * checkProfile.
+       */
+      void readCheckProfile(llvm::Module &M);
+
+      /**
+       * Hash the signatures and sizes of the basic blocks of the given function before it is
+       * instrumented, which tells whether counts from a profile still refer to the same blocks.
+       */
+      uint64_t getSignatureFingerprint(llvm::Function *F);
+
       llvm::BasicBlock* insertSignatureUpdate(
           llvm::BasicBlock *BB,
           llvm::BasicBlock *errorHandlingBlock,
@@ -48,8 +240,22 @@ namespace cfcss {
           Signature *signature,
           Signature *predecessorSignature,
           bool adjustForFanin,
+          bool check,
           llvm::IRBuilder<> *builder);
 
+      /**
+       * Create the table of functions that may be called indirectly and attach a header to each
+       * of their gateways, from which indirect calls look up the implementation to call and the
+       * signatures to hand over.
+       */
+      void createIndirectTargetTable(llvm::Module &M);
+
+      /**
+       * Look up the header of the function called by the given indirect call, redirecting the
+       * call to its implementation if it is a gateway from this module.
+       */
+      IndirectTargetLookup lookUpIndirectTarget(llvm::Instruction *callInst);
+
       llvm::Instruction* insertRuntimeAdjustingSignature(
           llvm::BasicBlock &BB,
           llvm::Value *D,
@@ -57,6 +263,58 @@ namespace cfcss {
 
       llvm::GlobalVariable *interFunctionGSR;
       llvm::GlobalVariable *interFunctionD;
+
+      llvm::Function *signatureFaultHandler;
+
+      /**
+       * The shared check functions of -cfcss-outline-cold-checks, created on first use, and the
+       * branch weights of inline checks.
+       */
+      llvm::Function *checkFunction;
+      llvm::Function *adjustingCheckFunction;
+      llvm::MDNode *checkWeights;
+
+      /**
+       * Layout of the prefix data of indirectly called gateways, a short jump over the header
+       * followed by a magic number, the table index and the signatures to hand over.
+       */
+      llvm::StructType *indirectTargetHeaderType;
+      llvm::GlobalVariable *indirectTargetTable;
+      llvm::GlobalVariable *unknownIndirectTarget;
+      uint32_t indirectTargetMagic;
+
+      llvm::DenseMap<llvm::Instruction*, IndirectTargetLookup> indirectTargetLookups;
+
+      /**
+       * The function given with -cfcss-fault-hook, NULL otherwise, and the layout of the check
+       * descriptors passed to it, which has to match struct cfcss_fault_site in CFCSSRuntime.h.
+       */
+      llvm::Constant *faultHook;
+      llvm::StructType *faultSiteType;
+      unsigned int numFaultSites;
+      llvm::DenseMap<llvm::Function*, llvm::Constant*> functionNames;
+
+      /**
+       * Stands in for the counter array with -cfcss-profile-checks until its size is known, and
+       * the function name, signature fingerprint, kind and signature of each counter so far.
+       */
+      llvm::GlobalVariable *profileCounters;
+      std::vector<llvm::Constant*> profileEntries;
+
+      /**
+       * Counts read from -cfcss-check-profile for this module, by function name.
+       */
+      llvm::StringMap<FunctionProfile> checkProfile;
+
+      /**
+       * Signature fingerprint of the function being instrumented.
+       */
+      uint64_t signatureFingerprint;
+
+      llvm::DenseMap<llvm::Function*, StateLoads> entryLoads;
+      llvm::DenseMap<llvm::Instruction*, StateStores> callSiteStores;
+      llvm::DenseMap<llvm::Instruction*, StateLoads> returnedStateLoads;
+      llvm::DenseMap<llvm::ReturnInst*, StateStores> returnStores;
   };
 
 }
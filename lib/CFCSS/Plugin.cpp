@@ -0,0 +1,38 @@
+#include "Common.h"
+#include "RemoveRedundantStateStores.h"
+#include "SignaturesInRegisters.h"
+
+#include "llvm/PassManager.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+using namespace llvm;
+
+namespace cfcss {
+
+  llvm::cl::opt<bool> PostInline("cfcss-post-inline",
+      llvm::cl::desc("Instrument at the end of the standard optimization pipeline, i.e. after "
+          "inlining and simplification, then pass GSR and D to internal functions as arguments "
+          "and clean up redundant accesses to interFunctionGSR and interFunctionD. Implies "
+          "-cfcss-ssa-registers. Has no effect at -O0."));
+
+}
+
+// Loading the library into opt or clang registers each pass through its RegisterPass. The
+// following also adds CFCSS to the pipelines that PassManagerBuilder populates, so clang can
+// instrument in-process without a round trip through opt:
+//
+//   clang -O2 -Xclang -load -Xclang CFCSS.so -mllvm -cfcss-post-inline ...
+//
+// Everything else CFCSS needs is scheduled through the analysis usage of these passes.
+static void addCFCSSPasses(const PassManagerBuilder &Builder, PassManagerBase &PM) {
+  if (cfcss::PostInline) {
+    // RemoveRedundantStateStores relies on GSR and D already being passed along in registers.
+    PM.add(new cfcss::SignaturesInRegisters());
+    PM.add(new cfcss::RemoveRedundantStateStores());
+  }
+}
+
+// Instrumented code must not be optimized any further, or checks against the signatures known in
+// gateways fold away, so CFCSS only ever goes at the very end of the pipeline. There is nothing
+// to do after inlining at -O0, which never inlines.
+static RegisterStandardPasses X(PassManagerBuilder::EP_OptimizerLast, addCFCSSPasses);
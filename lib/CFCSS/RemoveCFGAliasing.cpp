@@ -6,20 +6,24 @@
 #include "InstructionIndex.h"
 #include "SplitAfterCall.h"
 
-#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/Support/CFG.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 static const char *debugPrefix = "RemoveCFGAliasing: ";
 
 namespace cfcss {
 
+  STATISTIC(NumFaninBlocks, "Number of fanin nodes examined for aliasing");
   STATISTIC(NumAliasingBlocks, "Number of aliasing basic blocks found");
   STATISTIC(NumProxyBlocks, "Number of proxy blocks inserted");
 
@@ -28,6 +32,8 @@ namespace cfcss {
   bool RemoveCFGAliasing::runOnModule(Module &M) {
     bool modifiedCFG = false;
 
+    SmallVector<Edge, 16> aliasingEdges;
+
     for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
       if (fi->isDeclaration()) {
         DEBUG(errs() << debugPrefix << "Skipping [" << fi->getName() << "], is a declaration.\n");
@@ -36,34 +42,32 @@ namespace cfcss {
 
       DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "].\n");
 
-      for (Function::iterator i = fi->begin(), e = fi->end(); i != e; ++i) {
-        BlockToBlockSetMap *aliasingBlocks = getAliasingBlocks(i);
-        if (aliasingBlocks->size()) {
-          NumAliasingBlocks += aliasingBlocks->size() + 1;
-          // We will modify CFG during this run.
-          modifiedCFG = true;
-        }
+      aliasingEdges.clear();
+
+      {
+        NamedRegionTimer timer("Find aliasing edges", "CFCSS", TimePassesIsEnabled);
+        findAliasingEdges(*fi, aliasingEdges);
+      }
 
-        for (BlockToBlockSetMap::iterator via_i = aliasingBlocks->begin(),
-            via_e = aliasingBlocks->end(); via_i != via_e; ++via_i) {
+      if (!aliasingEdges.empty()) {
+        // We will modify CFG during this run.
+        modifiedCFG = true;
+      }
 
-          for (BlockSet::iterator alias_i = via_i->second->begin(), alias_e = via_i->second->end();
-              alias_i != alias_e; ++alias_i) {
+      NamedRegionTimer timer("Insert proxy blocks", "CFCSS", TimePassesIsEnabled);
 
-            DEBUG(
-              errs() << debugPrefix;
-              errs().indent(2).changeColor(raw_ostream::WHITE, true /* bold */);
-              errs() << "[" << i->getName() << "] and [" << (*alias_i)->getName() << "] via ["
-                  << via_i->first->getName() << "]\n";
-              errs().resetColor();
-            );
+      for (SmallVectorImpl<Edge>::iterator ei = aliasingEdges.begin(), ee = aliasingEdges.end();
+          ei != ee; ++ei) {
 
-            insertProxyBlock(via_i->first, *alias_i);
-            ++NumProxyBlocks;
-          }
-        }
+        DEBUG(
+          errs() << debugPrefix;
+          errs().indent(2).changeColor(raw_ostream::WHITE, true /* bold */);
+          errs() << "[" << ei->second->getName() << "] via [" << ei->first->getName() << "]\n";
+          errs().resetColor();
+        );
 
-        delete aliasingBlocks;
+        insertProxyBlock(ei->first, ei->second);
+        ++NumProxyBlocks;
       }
 
       DEBUG(
@@ -84,50 +88,204 @@ namespace cfcss {
     AU.addPreserved<SplitAfterCall>();
   }
 
-  BlockToBlockSetMap* RemoveCFGAliasing::getAliasingBlocks(BasicBlock *BB) {
-    BlockToBlockSetMap *aliasingBlocks = new BlockToBlockSetMap();
+  void RemoveCFGAliasing::releaseMemory() {
+    DenseMap<BasicBlock*, unsigned int>().swap(blockIndices);
+    std::vector<BasicBlock*>().swap(blocks);
+    std::vector<BlockInfo>().swap(blockInfos);
+    std::vector<unsigned int>().swap(predecessorIndices);
+    DenseMap<uint64_t, unsigned int>().swap(classesByFingerprint);
+    std::vector<FaninClass>().swap(faninClasses);
+  }
 
-    // FIXME(hermannloose): Might make control-flow a bit nicer here.
-    // The aliasing problem is limited to fanin nodes.
-    if (!BB->hasNUsesOrMore(2)) {
-      return aliasingBlocks;
+  void RemoveCFGAliasing::findAliasingEdges(Function &F, SmallVectorImpl<Edge> &aliasingEdges) {
+    blockIndices.clear();
+    blocks.clear();
+    blockInfos.clear();
+    predecessorIndices.clear();
+    classesByFingerprint.clear();
+    faninClasses.clear();
+
+    for (Function::iterator bi = F.begin(), be = F.end(); bi != be; ++bi) {
+      blockIndices.insert(std::make_pair(bi, blocks.size()));
+      blocks.push_back(bi);
     }
 
-    BlockSet *predecessors = new BlockSet(pred_begin(BB), pred_end(BB));
+    blockInfos.resize(blocks.size());
 
-    for (pred_iterator i = pred_begin(BB), e = pred_end(BB); i != e; ++i) {
-      BlockSet *aliasingSuccessors = new BlockSet();
+    // Count incoming edges, which makes a fanin node in AssignBlockSignatures as well, even if
+    // several of them come from the same switch.
+    for (unsigned int source = 0; source < blocks.size(); ++source) {
+      TerminatorInst *terminator = blocks[source]->getTerminator();
+      for (unsigned int idx = 0; idx < terminator->getNumSuccessors(); ++idx) {
+        ++blockInfos[blockIndices.lookup(terminator->getSuccessor(idx))].numEdges;
+      }
+    }
 
-      for (succ_iterator succ_i = succ_begin(*i), succ_e = succ_end(*i);
-          succ_i != succ_e; ++succ_i) {
+    indexPredecessors();
+    classifyFaninNodes();
 
-        if (*succ_i == BB) { continue; }
+    // A predecessor whose fanin successors don't all share their predecessors taints them.
+    for (unsigned int source = 0; source < blocks.size(); ++source) {
+      TerminatorInst *terminator = blocks[source]->getTerminator();
+      if (terminator->getNumSuccessors() < 2) {
+        continue;
+      }
 
-        // The aliasing problem is limited to fanin nodes.
-        if (succ_i->hasNUsesOrMore(2)) {
-          for (pred_iterator pred_i = pred_begin(*succ_i), pred_e = pred_end(*succ_i);
-              pred_i != pred_e; ++pred_i) {
+      unsigned int firstClass = 0;
+      bool hasFaninSuccessor = false;
+      bool offending = false;
 
-            // We only check whether the predecessors of succ_i are a subset of
-            // the predecessors of BB. Aliasing does occur in the superset case
-            // as well, which will be detected when running this method on
-            // succ_i later on.
-            if (!predecessors->count(*pred_i)) {
-              aliasingSuccessors->insert(*succ_i);
-              break;
-            }
-          }
+      for (unsigned int idx = 0; idx < terminator->getNumSuccessors(); ++idx) {
+        unsigned int target = blockIndices.lookup(terminator->getSuccessor(idx));
+        if (!isFaninNode(target)) {
+          continue;
+        }
+
+        if (!hasFaninSuccessor) {
+          firstClass = blockInfos[target].faninClass;
+          hasFaninSuccessor = true;
+        } else if (blockInfos[target].faninClass != firstClass) {
+          offending = true;
+          break;
         }
       }
 
-      if (!aliasingSuccessors->empty()) {
-        aliasingBlocks->insert(std::pair<BasicBlock*, BlockSet*>(*i, aliasingSuccessors));
-      } else {
-        delete aliasingSuccessors;
+      if (!offending) {
+        continue;
+      }
+
+      blockInfos[source].offending = true;
+      for (unsigned int idx = 0; idx < terminator->getNumSuccessors(); ++idx) {
+        unsigned int target = blockIndices.lookup(terminator->getSuccessor(idx));
+        if (isFaninNode(target)) {
+          faninClasses[blockInfos[target].faninClass].tainted = true;
+        }
       }
     }
 
-    return aliasingBlocks;
+    for (unsigned int idx = 0; idx < blocks.size(); ++idx) {
+      if (isFaninNode(idx)) {
+        ++NumFaninBlocks;
+
+        if (faninClasses[blockInfos[idx].faninClass].tainted) {
+          ++NumAliasingBlocks;
+        }
+      }
+
+      blockInfos[idx].lastSource = 0;
+    }
+
+    for (unsigned int source = 0; source < blocks.size(); ++source) {
+      TerminatorInst *terminator = blocks[source]->getTerminator();
+      if (terminator->getNumSuccessors() < 2) {
+        continue;
+      }
+
+      for (unsigned int idx = 0; idx < terminator->getNumSuccessors(); ++idx) {
+        BasicBlock *successor = terminator->getSuccessor(idx);
+        unsigned int target = blockIndices.lookup(successor);
+        BlockInfo &info = blockInfos[target];
+
+        // A single proxy block replaces all parallel edges.
+        if (!isFaninNode(target) || info.lastSource == source + 1) {
+          continue;
+        }
+
+        info.lastSource = source + 1;
+
+        FaninClass &faninClass = faninClasses[info.faninClass];
+        if (faninClass.tainted && (faninClass.size > 1 || blockInfos[source].offending)) {
+          aliasingEdges.push_back(Edge(blocks[source], successor));
+        }
+      }
+    }
+  }
+
+  void RemoveCFGAliasing::indexPredecessors() {
+    unsigned int offset = 0;
+    for (std::vector<BlockInfo>::iterator ii = blockInfos.begin(), ie = blockInfos.end();
+        ii != ie; ++ii) {
+
+      ii->predecessorsBegin = offset;
+      if (ii->numEdges > 1) {
+        // Parallel edges are only counted once, this is an upper bound.
+        offset += ii->numEdges;
+      }
+    }
+
+    predecessorIndices.resize(offset);
+
+    // Visiting sources in order keeps the predecessors of each fanin node sorted, so that equal
+    // sets of predecessors are equal sequences as well.
+    for (unsigned int source = 0; source < blocks.size(); ++source) {
+      TerminatorInst *terminator = blocks[source]->getTerminator();
+      for (unsigned int idx = 0; idx < terminator->getNumSuccessors(); ++idx) {
+        unsigned int target = blockIndices.lookup(terminator->getSuccessor(idx));
+        BlockInfo &info = blockInfos[target];
+
+        if (!isFaninNode(target) || info.lastSource == source + 1) {
+          continue;
+        }
+
+        info.lastSource = source + 1;
+        predecessorIndices[info.predecessorsBegin + info.numPredecessors++] = source;
+        info.fingerprint = (info.fingerprint ^ source) * 0x100000001b3ULL;
+      }
+    }
+  }
+
+  void RemoveCFGAliasing::classifyFaninNodes() {
+    // Keys must stay clear of the empty and tombstone keys of DenseMap.
+    const uint64_t keyMask = ~uint64_t(0) >> 1;
+
+    for (unsigned int idx = 0; idx < blocks.size(); ++idx) {
+      if (!isFaninNode(idx)) {
+        continue;
+      }
+
+      BlockInfo &info = blockInfos[idx];
+      uint64_t key = info.fingerprint & keyMask;
+
+      while (true) {
+        DenseMap<uint64_t, unsigned int>::iterator ci = classesByFingerprint.find(key);
+
+        if (ci == classesByFingerprint.end()) {
+          info.faninClass = faninClasses.size();
+          faninClasses.push_back(FaninClass(idx));
+          classesByFingerprint.insert(std::make_pair(key, info.faninClass));
+          break;
+        }
+
+        if (samePredecessors(faninClasses[ci->second].representative, idx)) {
+          info.faninClass = ci->second;
+          break;
+        }
+
+        // Different predecessors with the same fingerprint, probe on.
+        key = (key + 1) & keyMask;
+      }
+
+      ++faninClasses[info.faninClass].size;
+    }
+  }
+
+  bool RemoveCFGAliasing::isFaninNode(unsigned int idx) {
+    return blockInfos[idx].numEdges > 1;
+  }
+
+  bool RemoveCFGAliasing::samePredecessors(unsigned int first, unsigned int second) {
+    const BlockInfo &firstInfo = blockInfos[first];
+    const BlockInfo &secondInfo = blockInfos[second];
+
+    if (firstInfo.numPredecessors != secondInfo.numPredecessors) {
+      return false;
+    }
+
+    std::vector<unsigned int>::const_iterator firstBegin =
+        predecessorIndices.begin() + firstInfo.predecessorsBegin;
+
+    return std::equal(firstBegin, firstBegin + firstInfo.numPredecessors,
+        predecessorIndices.begin() + secondInfo.predecessorsBegin);
   }
 
   // FIXME(hermannloose): Assert that target is in fact a successor of source!
@@ -4,14 +4,28 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
+#include <vector>
+
 namespace cfcss {
 
   /**
    * Remove cases of fanin nodes in the CFG aliasing by inserting proxy blocks on all offending
    * edges.
+   *
+   * Fanin nodes, i.e. basic blocks with at least two incoming edges, alias if they share some but
+   * not all of their predecessors. Afterwards, all fanin successors of any basic block have the
+   * same set of predecessors.
+   *
+   * Fanin nodes with the same set of predecessors form a class. A predecessor with fanin
+   * successors in more than one class taints all of these classes, and only edges into tainted
+   * classes get proxy blocks: all of them for classes with several members, as proxying one edge
+   * would tell the members apart, and only those from offending predecessors otherwise. Finding
+   * these edges takes a fixed number of passes over the edges of a function, with scratch storage
+   * that is reused across functions.
    */
   class RemoveCFGAliasing : public llvm::ModulePass {
     public:
@@ -21,9 +35,58 @@ namespace cfcss {
 
       virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
       virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
 
     private:
-      BlockToBlockSetMap* getAliasingBlocks(llvm::BasicBlock *BB);
+      typedef std::pair<llvm::BasicBlock*, llvm::BasicBlock*> Edge;
+
+      /**
+       * Scratch information about a basic block, indexed by its position in the function.
+       */
+      struct BlockInfo {
+        BlockInfo() : numEdges(0), numPredecessors(0), lastSource(0), predecessorsBegin(0),
+            fingerprint(0), faninClass(0), offending(false) {}
+
+        unsigned int numEdges;
+        unsigned int numPredecessors;
+
+        // Index of the last predecessor seen plus one, to skip parallel edges.
+        unsigned int lastSource;
+
+        // Distinct predecessors of fanin nodes, in ascending order, in predecessorIndices.
+        unsigned int predecessorsBegin;
+        uint64_t fingerprint;
+
+        unsigned int faninClass;
+        bool offending;
+      };
+
+      /**
+       * Scratch information about a class of fanin nodes with the same predecessors.
+       */
+      struct FaninClass {
+        FaninClass(unsigned int representative) : representative(representative), size(0),
+            tainted(false) {}
+
+        unsigned int representative;
+        unsigned int size;
+        bool tainted;
+      };
+
+      // Scratch storage, reused across functions.
+      llvm::DenseMap<llvm::BasicBlock*, unsigned int> blockIndices;
+      std::vector<llvm::BasicBlock*> blocks;
+      std::vector<BlockInfo> blockInfos;
+      std::vector<unsigned int> predecessorIndices;
+      llvm::DenseMap<uint64_t, unsigned int> classesByFingerprint;
+      std::vector<FaninClass> faninClasses;
+
+      void findAliasingEdges(llvm::Function &F, llvm::SmallVectorImpl<Edge> &aliasingEdges);
+      void indexPredecessors();
+      void classifyFaninNodes();
+      bool isFaninNode(unsigned int idx);
+      bool samePredecessors(unsigned int first, unsigned int second);
+
       llvm::BasicBlock* insertProxyBlock(llvm::BasicBlock *source, llvm::BasicBlock *target);
   };
 
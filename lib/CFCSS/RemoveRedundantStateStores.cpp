@@ -0,0 +1,258 @@
+#define DEBUG_TYPE "cfcss-remove-redundant-state-stores"
+
+#include "RemoveRedundantStateStores.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char *debugPrefix = "RemoveRedundantStateStores: ";
+
+namespace cfcss {
+
+  STATISTIC(NumLoadsForwarded, "Number of state loads replaced with a known value");
+  STATISTIC(NumRedundantStores, "Number of state stores of a value already held");
+  STATISTIC(NumDeadStores, "Number of state stores overwritten before being read");
+  STATISTIC(NumReturnStoresRemoved, "Number of stores to interFunctionD before single returns");
+  STATISTIC(NumDeadLoads, "Number of state loads with unused results");
+
+  RemoveRedundantStateStores::RemoveRedundantStateStores() : ModulePass(ID),
+      GF(NULL), AA(NULL), interFunctionGSR(NULL), interFunctionD(NULL) {}
+
+
+  void RemoveRedundantStateStores::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<InstrumentBasicBlocks>();
+    AU.addRequired<GatewayFunctions>();
+    AU.addRequired<AliasAnalysis>();
+
+    // Same as with SignaturesInRegisters, the module must not be instrumented a second time.
+    AU.addPreserved<InstrumentBasicBlocks>();
+    AU.addPreserved<GatewayFunctions>();
+  }
+
+
+  bool RemoveRedundantStateStores::runOnModule(Module &M) {
+    InstrumentBasicBlocks &IBB = getAnalysis<InstrumentBasicBlocks>();
+    GF = &getAnalysis<GatewayFunctions>();
+    AA = &getAnalysis<AliasAnalysis>();
+
+    interFunctionGSR = IBB.getInterFunctionGSR();
+    interFunctionD = IBB.getInterFunctionD();
+
+    bool changed = false;
+
+    for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+      if (fi->isDeclaration()) {
+        continue;
+      }
+
+      DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "].\n");
+
+      changed |= removeReturnStoreOfD(*fi);
+      changed |= forwardStateInFunction(*fi);
+    }
+
+    changed |= removeDeadLoads(interFunctionGSR);
+    changed |= removeDeadLoads(interFunctionD);
+
+    return changed;
+  }
+
+
+  bool RemoveRedundantStateStores::forwardStateInFunction(Function &F) {
+    bool changed = false;
+
+    // Blocks with a unique predecessor start out knowing what their predecessor knew at its end,
+    // visiting in reverse post-order makes sure the predecessor has been seen by then.
+    DenseMap<BasicBlock*, State> exitStates;
+
+    ReversePostOrderTraversal<Function*> RPOT(&F);
+    for (ReversePostOrderTraversal<Function*>::rpo_iterator bi = RPOT.begin(), be = RPOT.end();
+        bi != be; ++bi) {
+
+      BasicBlock *BB = *bi;
+      State state;
+
+      if (BasicBlock *predecessor = BB->getUniquePredecessor()) {
+        DenseMap<BasicBlock*, State>::iterator exitState = exitStates.find(predecessor);
+        if (exitState != exitStates.end()) {
+          state = exitState->second;
+
+          // A store left pending on one path may still be read on another.
+          if (predecessor->getTerminator()->getNumSuccessors() != 1) {
+            state.first.pendingStore = NULL;
+            state.second.pendingStore = NULL;
+          }
+        }
+      }
+
+      changed |= forwardStateInBlock(*BB, state);
+      exitStates[BB] = state;
+    }
+
+    return changed;
+  }
+
+
+  bool RemoveRedundantStateStores::forwardStateInBlock(BasicBlock &BB, State &state) {
+    bool changed = false;
+
+    for (BasicBlock::iterator ii = BB.begin(), ie = BB.end(); ii != ie;) {
+      Instruction *I = ii++;
+
+      // The globals never alias each other, so an access to one tells nothing about the other.
+      if (!forwardAccess(I, interFunctionGSR, state.first, changed)) {
+        forwardAccess(I, interFunctionD, state.second, changed);
+      }
+    }
+
+    return changed;
+  }
+
+
+  bool RemoveRedundantStateStores::forwardAccess(Instruction *I, GlobalVariable *global,
+      GlobalState &state, bool &changed) {
+
+    if (LoadInst *loadInst = dyn_cast<LoadInst>(I)) {
+      if (loadInst->getPointerOperand() == global) {
+        if (!loadInst->isSimple()) {
+          state = GlobalState();
+        } else if (state.value) {
+          loadInst->replaceAllUsesWith(state.value);
+          loadInst->eraseFromParent();
+          ++NumLoadsForwarded;
+          changed = true;
+        } else {
+          state.value = loadInst;
+          state.pendingStore = NULL;
+        }
+
+        return true;
+      }
+    }
+
+    if (StoreInst *storeInst = dyn_cast<StoreInst>(I)) {
+      if (storeInst->getPointerOperand() == global) {
+        if (!storeInst->isSimple()) {
+          state = GlobalState();
+        } else if (storeInst->getValueOperand() == state.value) {
+          storeInst->eraseFromParent();
+          ++NumRedundantStores;
+          changed = true;
+        } else {
+          if (state.pendingStore) {
+            state.pendingStore->eraseFromParent();
+            ++NumDeadStores;
+            changed = true;
+          }
+
+          state.value = storeInst->getValueOperand();
+          state.pendingStore = storeInst;
+        }
+
+        return true;
+      }
+    }
+
+    AliasAnalysis::Location location(global,
+        AA->getTypeStoreSize(global->getType()->getElementType()));
+    AliasAnalysis::ModRefResult modRef = AA->getModRefInfo(I, location);
+
+    if (modRef & AliasAnalysis::Ref) {
+      state.pendingStore = NULL;
+    }
+
+    if (modRef & AliasAnalysis::Mod) {
+      state.value = NULL;
+    }
+
+    return false;
+  }
+
+
+  bool RemoveRedundantStateStores::removeReturnStoreOfD(Function &F) {
+    // Gateways reset D for whoever called them from outside the module, and indirect callers
+    // always pick it up, not knowing how many returns the callee has.
+    if (GF->isGateway(&F) || GF->isIndirectTarget(&F)) {
+      return false;
+    }
+
+    ReturnInst *returnInst = NULL;
+    for (Function::iterator bi = F.begin(), be = F.end(); bi != be; ++bi) {
+      if (ReturnInst *candidate = dyn_cast<ReturnInst>(bi->getTerminator())) {
+        if (returnInst) {
+          return false;
+        }
+
+        returnInst = candidate;
+      }
+    }
+
+    if (!returnInst) {
+      return false;
+    }
+
+    AliasAnalysis::Location location(interFunctionD,
+        AA->getTypeStoreSize(interFunctionD->getType()->getElementType()));
+
+    BasicBlock *returnBlock = returnInst->getParent();
+    for (BasicBlock::iterator ii = returnInst; ii != returnBlock->begin();) {
+      --ii;
+
+      if (StoreInst *storeInst = dyn_cast<StoreInst>(ii)) {
+        if (storeInst->getPointerOperand() == interFunctionD) {
+          if (!storeInst->isSimple()) {
+            return false;
+          }
+
+          DEBUG(errs() << debugPrefix << "Removing store to interFunctionD before single return "
+              << "of [" << F.getName() << "].\n");
+
+          storeInst->eraseFromParent();
+          ++NumReturnStoresRemoved;
+
+          return true;
+        }
+      }
+
+      if (AA->getModRefInfo(ii, location) & AliasAnalysis::Ref) {
+        return false;
+      }
+    }
+
+    return false;
+  }
+
+
+  bool RemoveRedundantStateStores::removeDeadLoads(GlobalVariable *global) {
+    SmallVector<LoadInst*, 16> deadLoads;
+    for (Value::use_iterator ui = global->use_begin(), ue = global->use_end(); ui != ue; ++ui) {
+      if (LoadInst *loadInst = dyn_cast<LoadInst>(*ui)) {
+        if (loadInst->use_empty() && loadInst->isSimple()) {
+          deadLoads.push_back(loadInst);
+        }
+      }
+    }
+
+    for (SmallVectorImpl<LoadInst*>::iterator li = deadLoads.begin(), le = deadLoads.end();
+        li != le; ++li) {
+
+      (*li)->eraseFromParent();
+      ++NumDeadLoads;
+    }
+
+    return !deadLoads.empty();
+  }
+
+
+  char RemoveRedundantStateStores::ID = 0;
+}
+
+static RegisterPass<cfcss::RemoveRedundantStateStores>
+    X("remove-redundant-state-stores", "Remove Redundant State Stores (CFCSS)");
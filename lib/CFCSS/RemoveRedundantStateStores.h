@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Common.h"
+#include "GatewayFunctions.h"
+#include "InstrumentBasicBlocks.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+namespace cfcss {
+
+  /**
+   * Remove loads and stores of interFunctionGSR and interFunctionD that instrumentation left
+   * behind but that cannot affect any signature check.
+   *
+   * Within basic blocks and along chains of blocks with a unique predecessor, loads are replaced
+   * with the value last stored or loaded, stores of the value the global is already known to hold
+   * are dropped, and stores that are overwritten before anything could read them are removed.
+   * Anything that may read or write the globals according to alias analysis, which includes all
+   * calls, ends what is known about them. Beyond that, interFunctionD is not stored before
+   * returning from functions with a single return, since callers only ever look at it when the
+   * called function has several returns, and loads whose results are unused are removed.
+   *
+   * GSR and D should be kept in SSA registers with -cfcss-ssa-registers, otherwise the values
+   * stored before consecutive calls never compare equal. This also has to run after
+   * SignaturesInRegisters if that is used at all, as the records InstrumentBasicBlocks keeps of
+   * its loads and stores are stale afterwards.
+   *
+   * With -cfcss-post-inline, which implies -cfcss-ssa-registers, SignaturesInRegisters and this
+   * pass are added to the end of the optimizing pipelines together with everything they depend
+   * on, e.g. when loaded into clang or opt -O2.
+   */
+  class RemoveRedundantStateStores : public llvm::ModulePass {
+    public:
+      static char ID;
+
+      RemoveRedundantStateStores();
+
+      virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+      virtual bool runOnModule(llvm::Module &M);
+
+    private:
+      /**
+       * What is known about one of the globals at some point in a function: the value it holds, if
+       * any, and the last store to it, if nothing may have read it since.
+       */
+      struct GlobalState {
+        GlobalState() : value(NULL), pendingStore(NULL) {}
+
+        llvm::Value *value;
+        llvm::StoreInst *pendingStore;
+      };
+
+      typedef std::pair<GlobalState, GlobalState> State;
+
+      GatewayFunctions *GF;
+      llvm::AliasAnalysis *AA;
+
+      llvm::GlobalVariable *interFunctionGSR;
+      llvm::GlobalVariable *interFunctionD;
+
+      bool forwardStateInFunction(llvm::Function &F);
+      bool forwardStateInBlock(llvm::BasicBlock &BB, State &state);
+      bool forwardAccess(llvm::Instruction *I, llvm::GlobalVariable *global, GlobalState &state,
+          bool &changed);
+
+      bool removeReturnStoreOfD(llvm::Function &F);
+      bool removeDeadLoads(llvm::GlobalVariable *global);
+  };
+
+}
@@ -0,0 +1,129 @@
+#define DEBUG_TYPE "cfcss-signature-regions"
+
+#include "SignatureRegions.h"
+
+#include "RemoveCFGAliasing.h"
+#include "SplitAfterCall.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static const char *debugPrefix = "SignatureRegions: ";
+
+namespace cfcss {
+
+  static llvm::cl::opt<bool> MergeRegions("cfcss-merge-regions",
+      llvm::cl::desc("Update and check signatures only once per straight-line chain of basic "
+          "blocks. The default is to update and check in every basic block."));
+
+  STATISTIC(NumRegions, "Number of signature regions");
+  STATISTIC(NumMergedBlocks, "Number of basic blocks merged into the region of a predecessor");
+
+  SignatureRegions::SignatureRegions() : ModulePass(ID), regionHeads() {}
+
+
+  void SignatureRegions::getAnalysisUsage(AnalysisUsage &AU) const {
+    // Regions have to be formed on the final CFG.
+    AU.addRequired<RemoveCFGAliasing>();
+    AU.addRequired<SplitAfterCall>();
+
+    AU.setPreservesAll();
+  }
+
+
+  bool SignatureRegions::runOnModule(Module &M) {
+    if (!MergeRegions) {
+      return false;
+    }
+
+    SplitAfterCall &SAC = getAnalysis<SplitAfterCall>();
+
+    for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+      if (fi->isDeclaration()) {
+        continue;
+      }
+
+      DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "] ... ");
+
+      BasicBlock *entryBlock = &fi->getEntryBlock();
+
+      for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
+        BasicBlock *predecessor = bi->getSinglePredecessor();
+
+        // Blocks returning from a call receive GSR from the callee, not from their predecessor.
+        if (bi == entryBlock || SAC.wasSplitAfterCall(bi) || !predecessor || predecessor == bi
+            || predecessor->getTerminator()->getNumSuccessors() != 1) {
+
+          ++NumRegions;
+          continue;
+        }
+
+        regionHeads.insert(BlockToBlockEntry(bi, predecessor));
+        ++NumMergedBlocks;
+      }
+
+      // Resolve chains to their heads. Chains without a head can only form unreachable cycles,
+      // those are cut where we first meet them.
+      for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
+        BasicBlock *head = regionHeads.lookup(bi);
+        if (!head) {
+          continue;
+        }
+
+        BlockSet chain;
+        chain.insert(bi);
+
+        while (BasicBlock *next = regionHeads.lookup(head)) {
+          if (!chain.insert(head)) {
+            break;
+          }
+          head = next;
+        }
+
+        if (head == bi) {
+          regionHeads.erase(bi);
+          ++NumRegions;
+          --NumMergedBlocks;
+        } else {
+          regionHeads[bi] = head;
+        }
+      }
+
+      DEBUG(
+        errs().changeColor(raw_ostream::GREEN);
+        errs() << "done\n";
+        errs().resetColor();
+      );
+    }
+
+    return false;
+  }
+
+
+  void SignatureRegions::releaseMemory() {
+    regionHeads.clear();
+  }
+
+
+  BasicBlock* SignatureRegions::getRegionHead(BasicBlock * const BB) {
+    if (BasicBlock *head = regionHeads.lookup(BB)) {
+      return head;
+    }
+
+    return BB;
+  }
+
+
+  bool SignatureRegions::isRegionHead(BasicBlock * const BB) {
+    return !regionHeads.count(BB);
+  }
+
+
+  char SignatureRegions::ID = 0;
+}
+
+static RegisterPass<cfcss::SignatureRegions> X("signature-regions", "Signature Regions (CFCSS)");
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Common.h"
+
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+namespace cfcss {
+
+  /**
+   * Fold straight-line chains of basic blocks into signature regions.
+   *
+   * If a basic block has exactly one predecessor and that predecessor has exactly one successor,
+   * the signature difference between the two is a compile-time constant and checking it at both
+   * blocks only repeats work. Such chains form a single region that shares the signature of its
+   * first block, the region head, which is the only block of the region where GSR is updated and
+   * checked. Blocks entered by returning from a call always start a new region.
+   *
+   * Regions are only formed with -cfcss-merge-regions, otherwise every basic block is the head of
+   * its own region.
+   */
+  class SignatureRegions : public llvm::ModulePass {
+    public:
+      static char ID;
+
+      SignatureRegions();
+
+      virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+      virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
+
+      /**
+       * Get the first basic block of the region containing the given basic block.
+       */
+      llvm::BasicBlock* getRegionHead(llvm::BasicBlock * const BB);
+
+      /**
+       * Check whether the given basic block starts a region.
+       */
+      bool isRegionHead(llvm::BasicBlock * const BB);
+
+    private:
+      BlockToBlockMap regionHeads;
+  };
+
+}
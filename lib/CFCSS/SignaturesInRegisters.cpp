@@ -0,0 +1,283 @@
+#define DEBUG_TYPE "cfcss-signatures-in-registers"
+
+#include "SignaturesInRegisters.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <vector>
+
+using namespace llvm;
+
+static const char *debugPrefix = "SignaturesInRegisters: ";
+
+namespace cfcss {
+
+  STATISTIC(NumFunctionsRewritten, "Number of functions receiving GSR and D as arguments");
+  STATISTIC(NumCallSitesRewritten, "Number of call sites passing GSR and D as arguments");
+
+  SignaturesInRegisters::SignaturesInRegisters() : ModulePass(ID) {}
+
+
+  void SignaturesInRegisters::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<InstrumentBasicBlocks>();
+
+    // Keep the pass manager from instrumenting the module a second time should a later pass ask
+    // for InstrumentBasicBlocks again. Its records of rewritten instructions are stale, though.
+    AU.addPreserved<InstrumentBasicBlocks>();
+  }
+
+
+  bool SignaturesInRegisters::runOnModule(Module &M) {
+    IBB = &getAnalysis<InstrumentBasicBlocks>();
+
+    std::vector<Function*> candidates;
+    for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+      if (canPassInRegisters(fi)) {
+        candidates.push_back(fi);
+      }
+    }
+
+    for (std::vector<Function*>::iterator fi = candidates.begin(), fe = candidates.end();
+        fi != fe; ++fi) {
+
+      Function *F = *fi;
+
+      DEBUG(errs() << debugPrefix << "Rewriting [" << F->getName() << "].\n");
+
+      // Collect call sites up front, rewriting them invalidates the use iterator.
+      SmallVector<CallInst*, 16> callSites;
+      for (Value::use_iterator ui = F->use_begin(), ue = F->use_end(); ui != ue; ++ui) {
+        callSites.push_back(cast<CallInst>(*ui));
+      }
+
+      Function *NF = rewriteFunction(F);
+
+      for (SmallVectorImpl<CallInst*>::iterator ci = callSites.begin(), ce = callSites.end();
+          ci != ce; ++ci) {
+
+        rewriteCallSite(*ci, NF);
+        ++NumCallSitesRewritten;
+      }
+
+      F->eraseFromParent();
+      ++NumFunctionsRewritten;
+    }
+
+    return !candidates.empty();
+  }
+
+
+  bool SignaturesInRegisters::canPassInRegisters(Function * const F) {
+    if (F->isDeclaration() || !F->hasLocalLinkage() || F->isVarArg()) {
+      return false;
+    }
+
+    // Gateways and anything else we didn't instrument as a callee keep using the globals.
+    if (!IBB->getEntryLoads(F).first) {
+      return false;
+    }
+
+    for (Value::use_iterator ui = F->use_begin(), ue = F->use_end(); ui != ue; ++ui) {
+      CallInst *callInst = dyn_cast<CallInst>(*ui);
+
+      // Invokes would need their normal destination rewritten to unpack the returned registers.
+      InvokeInst *invoke = dyn_cast<InvokeInst>(*ui);
+      if (invoke && ui.getOperandNo() == invoke->getNumOperands() - 3) {
+        DEBUG(errs() << debugPrefix << "Skipping [" << F->getName() << "] (invoked)\n");
+
+        return false;
+      }
+
+      // The called value is the last operand of a call instruction, any other use means that the
+      // address of the function escapes and it may be called by code that we don't rewrite.
+      if (!callInst || ui.getOperandNo() != callInst->getNumOperands() - 1) {
+        DEBUG(errs() << debugPrefix << "Skipping [" << F->getName() << "] (address taken)\n");
+
+        return false;
+      }
+
+      if (!IBB->getCallSiteStores(callInst).first) {
+        DEBUG(errs() << debugPrefix << "Skipping [" << F->getName() << "] (uninstrumented call "
+            << "site)\n");
+
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  Function* SignaturesInRegisters::rewriteFunction(Function *F) {
+    LLVMContext &context = F->getContext();
+    FunctionType *functionType = F->getFunctionType();
+    Type *signatureType = IBB->getInterFunctionGSR()->getType()->getElementType();
+
+    std::vector<Type*> params(functionType->param_begin(), functionType->param_end());
+    params.push_back(signatureType);
+    params.push_back(signatureType);
+
+    std::vector<Type*> results;
+    if (!functionType->getReturnType()->isVoidTy()) {
+      results.push_back(functionType->getReturnType());
+    }
+    results.push_back(signatureType);
+    results.push_back(signatureType);
+
+    FunctionType *newFunctionType =
+        FunctionType::get(StructType::get(context, results), params, false);
+
+    Function *NF = Function::Create(newFunctionType, F->getLinkage());
+    NF->copyAttributesFrom(F);
+
+    // Attributes on the return value don't carry over to the aggregate we return now.
+    AttributeSet attributes = F->getAttributes();
+    NF->setAttributes(attributes.removeAttributes(
+        context, AttributeSet::ReturnIndex, attributes.getRetAttributes()));
+
+    F->getParent()->getFunctionList().insert(F, NF);
+    NF->takeName(F);
+
+    // Move the body over instead of cloning it, basic blocks and thus block signatures stay the
+    // same this way.
+    NF->getBasicBlockList().splice(NF->begin(), F->getBasicBlockList());
+
+    Function::arg_iterator nai = NF->arg_begin();
+    for (Function::arg_iterator ai = F->arg_begin(), ae = F->arg_end(); ai != ae; ++ai, ++nai) {
+      ai->replaceAllUsesWith(nai);
+      nai->takeName(ai);
+    }
+
+    Argument *argumentGSR = nai++;
+    Argument *argumentD = nai;
+    argumentGSR->setName("GSR");
+    argumentD->setName("D");
+
+    StateLoads entryLoads = IBB->getEntryLoads(F);
+    entryLoads.first->replaceAllUsesWith(argumentGSR);
+    entryLoads.first->eraseFromParent();
+    entryLoads.second->replaceAllUsesWith(argumentD);
+    entryLoads.second->eraseFromParent();
+
+    SmallVector<ReturnInst*, 16> returns;
+    for (Function::iterator bi = NF->begin(), be = NF->end(); bi != be; ++bi) {
+      if (ReturnInst *returnInst = dyn_cast<ReturnInst>(bi->getTerminator())) {
+        returns.push_back(returnInst);
+      }
+    }
+
+    for (SmallVectorImpl<ReturnInst*>::iterator ri = returns.begin(), re = returns.end();
+        ri != re; ++ri) {
+
+      rewriteReturn(*ri, signatureType);
+    }
+
+    return NF;
+  }
+
+
+  void SignaturesInRegisters::rewriteReturn(ReturnInst *returnInst, Type *signatureType) {
+    StateStores stores = IBB->getReturnStores(returnInst);
+
+    // Functions that were deemed not to return never had their returns instrumented.
+    Value *returnedGSR = Constant::getNullValue(signatureType);
+    Value *returnedD = Constant::getNullValue(signatureType);
+
+    if (stores.first) {
+      returnedGSR = stores.first->getValueOperand();
+      stores.first->eraseFromParent();
+    }
+
+    if (stores.second) {
+      returnedD = stores.second->getValueOperand();
+      stores.second->eraseFromParent();
+    }
+
+    Function *F = returnInst->getParent()->getParent();
+    IRBuilder<> builder(returnInst);
+
+    Value *result = UndefValue::get(F->getReturnType());
+    unsigned idx = 0;
+
+    if (Value *returnValue = returnInst->getReturnValue()) {
+      result = builder.CreateInsertValue(result, returnValue, idx++);
+    }
+
+    result = builder.CreateInsertValue(result, returnedGSR, idx++);
+    result = builder.CreateInsertValue(result, returnedD, idx);
+
+    builder.CreateRet(result);
+    returnInst->eraseFromParent();
+  }
+
+
+  void SignaturesInRegisters::rewriteCallSite(CallInst *callInst, Function *NF) {
+    LLVMContext &context = callInst->getContext();
+
+    StateStores stores = IBB->getCallSiteStores(callInst);
+    StateLoads loads = IBB->getReturnedStateLoads(callInst);
+
+    std::vector<Value*> arguments;
+    for (unsigned int idx = 0; idx < callInst->getNumArgOperands(); ++idx) {
+      arguments.push_back(callInst->getArgOperand(idx));
+    }
+
+    Value *GSR = stores.first->getValueOperand();
+    arguments.push_back(GSR);
+    stores.first->eraseFromParent();
+
+    // D is only stored for calls to fanin nodes, nobody else looks at it upon entry.
+    if (stores.second) {
+      arguments.push_back(stores.second->getValueOperand());
+      stores.second->eraseFromParent();
+    } else {
+      arguments.push_back(Constant::getNullValue(GSR->getType()));
+    }
+
+    IRBuilder<> builder(callInst);
+
+    CallInst *newCall = builder.CreateCall(NF, arguments);
+    newCall->setCallingConv(callInst->getCallingConv());
+    newCall->setTailCall(callInst->isTailCall());
+    newCall->setDebugLoc(callInst->getDebugLoc());
+
+    AttributeSet attributes = callInst->getAttributes();
+    newCall->setAttributes(attributes.removeAttributes(
+        context, AttributeSet::ReturnIndex, attributes.getRetAttributes()));
+
+    unsigned idx = 0;
+
+    if (!callInst->getType()->isVoidTy()) {
+      Value *result = builder.CreateExtractValue(newCall, idx++);
+      callInst->replaceAllUsesWith(result);
+      result->takeName(callInst);
+    }
+
+    // Calls to functions that don't return were never split and have nothing to pick up.
+    if (loads.first) {
+      loads.first->replaceAllUsesWith(builder.CreateExtractValue(newCall, idx, "GSR"));
+      loads.first->eraseFromParent();
+    }
+
+    if (loads.second) {
+      loads.second->replaceAllUsesWith(builder.CreateExtractValue(newCall, idx + 1, "D"));
+      loads.second->eraseFromParent();
+    }
+
+    callInst->eraseFromParent();
+  }
+
+
+  char SignaturesInRegisters::ID = 0;
+}
+
+static RegisterPass<cfcss::SignaturesInRegisters>
+    X("signatures-in-registers", "Pass Signatures in Registers (CFCSS)");
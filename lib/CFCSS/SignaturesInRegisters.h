@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Common.h"
+#include "InstrumentBasicBlocks.h"
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+namespace cfcss {
+
+  /**
+   * Pass GSR and D to internal functions as arguments instead of through interFunctionGSR and
+   * interFunctionD.
+   *
+   * This rewrites every instrumented function with local linkage that is only ever called
+   * directly, such as the *_cfcss_internal implementations behind gateways, to take GSR and D as
+   * two additional trailing arguments and to return them alongside its actual return value as
+   * { <return value>, GSR, D }, or { GSR, D } for void functions. Call sites are rewritten to
+   * match, which leaves the thread-local globals in use only at gateway boundaries and for
+   * functions whose address is taken.
+   */
+  class SignaturesInRegisters : public llvm::ModulePass {
+    public:
+      static char ID;
+
+      SignaturesInRegisters();
+
+      virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
+      virtual bool runOnModule(llvm::Module &M);
+
+    private:
+      InstrumentBasicBlocks *IBB;
+
+      bool canPassInRegisters(llvm::Function * const F);
+
+      llvm::Function* rewriteFunction(llvm::Function *F);
+      void rewriteReturn(llvm::ReturnInst *returnInst, llvm::Type *signatureType);
+      void rewriteCallSite(llvm::CallInst *callInst, llvm::Function *NF);
+  };
+
+}
@@ -6,9 +6,12 @@
 #include "InstructionIndex.h"
 #include "RemoveCFGAliasing.h"
 
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/InlineAsm.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/Support/CFG.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -20,11 +23,13 @@ static const char *debugPrefix = "SplitAfterCall: ";
 namespace cfcss {
 
   STATISTIC(NumBlocksSplit, "Number of basic blocks split after call instructions");
+  STATISTIC(NumInvokeEdgesSplit, "Number of edges to the normal destination of invokes split");
+  STATISTIC(NumLandingPadsSplit, "Number of landing pads split between their invokes");
 
   typedef std::pair<BasicBlock*, Function*> BlockToFunctionEntry;
 
   SplitAfterCall::SplitAfterCall() : ModulePass(ID), ignoreBlocks(), afterCall(),
-      returnFromCallTo() {}
+      returnFromCallTo(), returnFromCallSite() {}
 
   void SplitAfterCall::getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequiredTransitive<InstructionIndex>();
@@ -49,6 +54,20 @@ namespace cfcss {
 
       DEBUG(errs() << debugPrefix << "Running on [" << fi->getName() << "].\n");
 
+      SmallVector<BasicBlock*, 16> sharedLandingPads;
+      for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
+        if (bi->isLandingPad() && !bi->getSinglePredecessor()) {
+          sharedLandingPads.push_back(bi);
+        }
+      }
+
+      for (SmallVectorImpl<BasicBlock*>::iterator bi = sharedLandingPads.begin(),
+          be = sharedLandingPads.end(); bi != be; ++bi) {
+
+        splitLandingPad(*bi);
+        modifiedCFG = true;
+      }
+
       for (Function::iterator bi = fi->begin(), be = fi->end(); bi != be; ++bi) {
         // FIXME(hermannloose): This might not be needed.
         if (ignoreBlocks.count(bi)) {
@@ -75,6 +94,7 @@ namespace cfcss {
                 BasicBlock *afterCallBlock = llvm::SplitBlock(bi, nextInst, this);
                 afterCall.insert(afterCallBlock);
                 returnFromCallTo.insert(BlockToFunctionEntry(afterCallBlock, calledFunction));
+                returnFromCallSite.insert(std::make_pair(afterCallBlock, callInst));
                 ignoreBlocks.insert(bi);
 
                 ++NumBlocksSplit;
@@ -83,6 +103,19 @@ namespace cfcss {
                 // We won't have signatures for those functions.
                 DEBUG(errs() << debugPrefix << "Called function is a declaration, skipping.\n");
               }
+            } else if (IndirectCalls && !callInst->isInlineAsm() && !callInst->doesNotReturn()) {
+              // Whether and where to pick up GSR from the callee is only decided at runtime.
+              BasicBlock::iterator nextInst(ii);
+              ++nextInst;
+
+              BasicBlock *afterCallBlock = llvm::SplitBlock(bi, nextInst, this);
+              afterCall.insert(afterCallBlock);
+              returnFromCallTo.insert(BlockToFunctionEntry(afterCallBlock, NULL));
+              returnFromCallSite.insert(std::make_pair(afterCallBlock, callInst));
+              ignoreBlocks.insert(bi);
+
+              ++NumBlocksSplit;
+              modifiedCFG = true;
             } else {
               // We can't handle function pointers, inline assembly, etc.
               DEBUG(
@@ -94,6 +127,25 @@ namespace cfcss {
             }
           }
         }
+
+        // Any calls before the invoke have been split off by now.
+        if (InvokeInst *invokeInst = dyn_cast<InvokeInst>(bi->getTerminator())) {
+          Function *calledFunction = invokeInst->getCalledFunction();
+
+          bool returns = false;
+          if (calledFunction) {
+            returns = !(calledFunction->isDeclaration() || calledFunction->isIntrinsic())
+                && !II.doesNotReturn(calledFunction);
+          } else {
+            returns = IndirectCalls && !isa<InlineAsm>(invokeInst->getCalledValue())
+                && !invokeInst->doesNotReturn();
+          }
+
+          if (returns) {
+            splitAfterInvoke(invokeInst, calledFunction);
+            modifiedCFG = true;
+          }
+        }
       }
 
       DEBUG(errs() << debugPrefix << "Finished on [" << fi->getName() << "].\n");
@@ -103,6 +155,14 @@ namespace cfcss {
   }
 
 
+  void SplitAfterCall::releaseMemory() {
+    ignoreBlocks.clear();
+    afterCall.clear();
+    returnFromCallTo.clear();
+    returnFromCallSite.clear();
+  }
+
+
   bool SplitAfterCall::wasSplitAfterCall(BasicBlock * const BB) {
     return afterCall.count(BB);
   }
@@ -112,6 +172,73 @@ namespace cfcss {
     return returnFromCallTo.lookup(BB);
   }
 
+
+  Instruction* SplitAfterCall::getCallSiteForReturnBlock(BasicBlock * const BB) {
+    return returnFromCallSite.lookup(BB);
+  }
+
+
+  void SplitAfterCall::splitLandingPad(BasicBlock *BB) {
+    DEBUG(errs() << debugPrefix << "Splitting landing pad [" << BB->getName() << "].\n");
+
+    // Like llvm::SplitLandingPadPredecessors(), but for every predecessor at once.
+    SmallVector<BasicBlock*, 8> predecessors(pred_begin(BB), pred_end(BB));
+    LandingPadInst *landingPad = BB->getLandingPadInst();
+
+    PHINode *mergedLandingPad = PHINode::Create(landingPad->getType(), predecessors.size(),
+        landingPad->getName(), landingPad);
+
+    for (SmallVectorImpl<BasicBlock*>::iterator pi = predecessors.begin(),
+        pe = predecessors.end(); pi != pe; ++pi) {
+
+      BasicBlock *predecessor = *pi;
+      BasicBlock *ownLandingPad = BasicBlock::Create(
+          BB->getContext(),
+          BB->getName() + ".cfcss",
+          BB->getParent(),
+          BB);
+
+      Instruction *clonedLandingPad = landingPad->clone();
+      ownLandingPad->getInstList().push_back(clonedLandingPad);
+      BranchInst::Create(BB, ownLandingPad);
+
+      cast<InvokeInst>(predecessor->getTerminator())->setUnwindDest(ownLandingPad);
+
+      PHINode *phiNode = NULL;
+      for (BasicBlock::iterator ii = BB->begin(); (phiNode = dyn_cast<PHINode>(ii)); ++ii) {
+        int idx = phiNode->getBasicBlockIndex(predecessor);
+        if (idx >= 0) {
+          phiNode->setIncomingBlock(idx, ownLandingPad);
+        }
+      }
+
+      mergedLandingPad->addIncoming(clonedLandingPad, ownLandingPad);
+    }
+
+    landingPad->replaceAllUsesWith(mergedLandingPad);
+    landingPad->eraseFromParent();
+
+    ++NumLandingPadsSplit;
+  }
+
+
+  void SplitAfterCall::splitAfterInvoke(InvokeInst *invokeInst, Function *calledFunction) {
+    BasicBlock *afterCallBlock = invokeInst->getNormalDest();
+
+    // Other predecessors mustn't pick up whatever the called function left behind.
+    if (!afterCallBlock->getSinglePredecessor()) {
+      afterCallBlock = SplitCriticalEdge(invokeInst, 0, this);
+      ++NumInvokeEdgesSplit;
+    }
+
+    DEBUG(errs() << debugPrefix << "Returning from invoke in ["
+        << invokeInst->getParent()->getName() << "] to [" << afterCallBlock->getName() << "].\n");
+
+    afterCall.insert(afterCallBlock);
+    returnFromCallTo.insert(BlockToFunctionEntry(afterCallBlock, calledFunction));
+    returnFromCallSite.insert(std::make_pair(afterCallBlock, invokeInst));
+  }
+
   char SplitAfterCall::ID = 0;
 }
 
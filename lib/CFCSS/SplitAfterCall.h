@@ -4,6 +4,7 @@
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
@@ -16,6 +17,11 @@ namespace cfcss {
    * flow. In order to treat the remaining code in those basic blocks like a normal basic block
    * that control flow can arrive at and where signatures have to be checked, we split them for
    * easier handling.
+   *
+   * Invokes already terminate their basic block. Their normal destination is treated like the
+   * remainder of a split block, with the edge split if the destination has other predecessors.
+   * Landing pads shared by several invokes are split so that each invoke unwinds to a landing pad
+   * of its own, which leaves the signature adjustment for the shared code to the unwind path.
    */
   class SplitAfterCall : public llvm::ModulePass {
     public:
@@ -25,6 +31,7 @@ namespace cfcss {
 
       virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const;
       virtual bool runOnModule(llvm::Module &M);
+      virtual void releaseMemory();
 
       /**
        * Check whether the given basic block is the remainder of another basic block that was split
@@ -33,16 +40,38 @@ namespace cfcss {
       bool wasSplitAfterCall(llvm::BasicBlock * const BB);
 
       /**
-       * Get the function that we just returned from when entering the given basic block.
+       * Get the function that we just returned from when entering the given basic block, NULL if
+       * it was called indirectly.
        *
        * This implies that wasSplitAfterCall(BB) is true.
        */
       llvm::Function* getCalledFunctionForReturnBlock(llvm::BasicBlock * const BB);
 
+      /**
+       * Get the call or invoke instruction that we just returned from when entering the given
+       * basic block.
+       *
+       * This implies that wasSplitAfterCall(BB) is true.
+       */
+      llvm::Instruction* getCallSiteForReturnBlock(llvm::BasicBlock * const BB);
+
     private:
       BlockSet ignoreBlocks;
       BlockSet afterCall;
       BlockToFunctionMap returnFromCallTo;
+      llvm::DenseMap<llvm::BasicBlock*, llvm::Instruction*> returnFromCallSite;
+
+      /**
+       * Give every predecessor of the given landing pad a landing pad of its own, which branches
+       * to the original one.
+       */
+      void splitLandingPad(llvm::BasicBlock *BB);
+
+      /**
+       * Mark the normal destination of the given invoke as the block returned to from the called
+       * function, splitting the edge if needed.
+       */
+      void splitAfterInvoke(llvm::InvokeInst *invokeInst, llvm::Function *calledFunction);
   };
 
 }
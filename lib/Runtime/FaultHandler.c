@@ -0,0 +1,107 @@
+/*
+ * Signature fault handling for CFCSS-instrumented programs.
+ *
+ * Programs instrumented with -cfcss-fault-hook=cfcss_signature_fault call into here instead of
+ * trapping when a check fails, and are linked against libCFCSSRuntime.a. Each check passes its own
+ * site, whose counter is bumped with a single atomic add. The first fault at a site also pushes it
+ * onto a lock-free list, so that reporting never has to look at sites that never faulted.
+ *
+ * The policy comes from CFCSS_FAULT_POLICY:
+ *
+ *   abort     report the fault and abort(), as close as it gets to the default trap
+ *   continue  report the first fault at each site, then carry on with the expected signature
+ *
+ * Under either policy a summary of all faulted sites goes to stderr at exit, or to the file named
+ * by CFCSS_FAULT_LOG.
+ */
+
+#include "CFCSSRuntime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct cfcss_fault_site *faulted_sites = NULL;
+static uint64_t total_faults = 0;
+static enum cfcss_fault_policy fault_policy = CFCSS_FAULT_ABORT;
+
+static FILE *open_log(void) {
+  const char *path = getenv("CFCSS_FAULT_LOG");
+  FILE *log = NULL;
+
+  if (path && *path) {
+    log = fopen(path, "a");
+  }
+
+  return log ? log : stderr;
+}
+
+static void report_site(const struct cfcss_fault_site *site, void *data) {
+  fprintf((FILE *) data, "cfcss: %llu fault(s) at check %u in %s\n",
+      (unsigned long long) __atomic_load_n(&site->count, __ATOMIC_RELAXED), site->id,
+      site->function);
+}
+
+static void report_summary(void) {
+  if (!cfcss_fault_count()) {
+    return;
+  }
+
+  FILE *log = open_log();
+  cfcss_for_each_fault_site(report_site, log);
+  fprintf(log, "cfcss: %llu signature fault(s) in total\n",
+      (unsigned long long) cfcss_fault_count());
+
+  if (log != stderr) {
+    fclose(log);
+  }
+}
+
+__attribute__((constructor))
+static void initialize(void) {
+  const char *policy = getenv("CFCSS_FAULT_POLICY");
+
+  if (policy && !strcmp(policy, "continue")) {
+    fault_policy = CFCSS_FAULT_CONTINUE;
+  }
+
+  atexit(report_summary);
+}
+
+__attribute__((cold, noinline))
+void cfcss_signature_fault(struct cfcss_fault_site *site, uint64_t expected, uint64_t observed) {
+  __atomic_fetch_add(&total_faults, 1, __ATOMIC_RELAXED);
+
+  if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) == 0) {
+    struct cfcss_fault_site *head = __atomic_load_n(&faulted_sites, __ATOMIC_RELAXED);
+    do {
+      site->next = head;
+    } while (!__atomic_compare_exchange_n(&faulted_sites, &head, site, 1, __ATOMIC_RELEASE,
+        __ATOMIC_RELAXED));
+
+    fprintf(stderr, "cfcss: signature fault at check %u in %s, expected %#llx, observed %#llx\n",
+        site->id, site->function, (unsigned long long) expected, (unsigned long long) observed);
+  }
+
+  if (__atomic_load_n(&fault_policy, __ATOMIC_RELAXED) == CFCSS_FAULT_ABORT) {
+    report_summary();
+    abort();
+  }
+}
+
+void cfcss_set_fault_policy(enum cfcss_fault_policy policy) {
+  __atomic_store_n(&fault_policy, policy, __ATOMIC_RELAXED);
+}
+
+uint64_t cfcss_fault_count(void) {
+  return __atomic_load_n(&total_faults, __ATOMIC_RELAXED);
+}
+
+void cfcss_for_each_fault_site(void (*callback)(const struct cfcss_fault_site *site, void *data),
+    void *data) {
+
+  const struct cfcss_fault_site *site = __atomic_load_n(&faulted_sites, __ATOMIC_ACQUIRE);
+  for (; site; site = site->next) {
+    callback(site, data);
+  }
+}
@@ -0,0 +1,63 @@
+/*
+ * Check execution counts for CFCSS-instrumented programs.
+ *
+ * Modules instrumented with -cfcss-profile-checks register their counter arrays from a constructor.
+ * At exit, the counts of all of them are appended to $CFCSS_PROFILE, or cfcss.profile in the
+ * current directory, one counter per line after a line naming its module:
+ *
+ *   module <identifier>
+ *   <function> <fingerprint> <update|adjust> <signature> <count>
+ *
+ * Counts from several runs simply add up when read back with -cfcss-check-profile.
+ */
+
+#include "CFCSSRuntime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static struct cfcss_profile *profiles = NULL;
+static int registered_writer = 0;
+
+static const char *kind_names[] = { "update", "adjust" };
+
+static void write_profile_at_exit(void) {
+  const char *path = getenv("CFCSS_PROFILE");
+  cfcss_write_profile(path && *path ? path : "cfcss.profile");
+}
+
+void cfcss_register_profile(struct cfcss_profile *profile) {
+  struct cfcss_profile *head = __atomic_load_n(&profiles, __ATOMIC_RELAXED);
+  do {
+    profile->next = head;
+  } while (!__atomic_compare_exchange_n(&profiles, &head, profile, 1, __ATOMIC_RELEASE,
+      __ATOMIC_RELAXED));
+
+  if (!__atomic_exchange_n(&registered_writer, 1, __ATOMIC_RELAXED)) {
+    atexit(write_profile_at_exit);
+  }
+}
+
+int cfcss_write_profile(const char *path) {
+  FILE *file = fopen(path, "a");
+  if (!file) {
+    perror("cfcss: could not write check profile");
+    return -1;
+  }
+
+  const struct cfcss_profile *profile = __atomic_load_n(&profiles, __ATOMIC_ACQUIRE);
+  for (; profile; profile = profile->next) {
+    fprintf(file, "module %s\n", profile->module);
+
+    for (uint32_t idx = 0; idx < profile->num_counters; ++idx) {
+      const struct cfcss_profile_entry *entry = &profile->entries[idx];
+      const char *kind = entry->kind < 2 ? kind_names[entry->kind] : "unknown";
+
+      fprintf(file, "%s %#llx %s %#llx %llu\n", entry->function,
+          (unsigned long long) entry->fingerprint, kind, (unsigned long long) entry->signature,
+          (unsigned long long) profile->counters[idx]);
+    }
+  }
+
+  return fclose(file);
+}
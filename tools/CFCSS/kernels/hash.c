@@ -0,0 +1,78 @@
+/*
+ * Hashing: FNV-1a over a buffer and an open addressing hash table with linear probing, tight
+ * loops with few branches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TABLE_SIZE (1 << 16)
+#define KEYS (TABLE_SIZE / 2)
+#define ROUNDS 64
+
+struct entry {
+  unsigned int key;
+  unsigned int value;
+};
+
+static unsigned int fnv1a(const unsigned char *data, size_t length) {
+  unsigned int hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < length; ++i) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static void insert(struct entry *table, unsigned int key, unsigned int value) {
+  unsigned int slot = fnv1a((const unsigned char *) &key, sizeof(key)) & (TABLE_SIZE - 1);
+
+  while (table[slot].key && table[slot].key != key) {
+    slot = (slot + 1) & (TABLE_SIZE - 1);
+  }
+
+  table[slot].key = key;
+  table[slot].value += value;
+}
+
+static unsigned int lookup(const struct entry *table, unsigned int key) {
+  unsigned int slot = fnv1a((const unsigned char *) &key, sizeof(key)) & (TABLE_SIZE - 1);
+
+  while (table[slot].key) {
+    if (table[slot].key == key) {
+      return table[slot].value;
+    }
+    slot = (slot + 1) & (TABLE_SIZE - 1);
+  }
+
+  return 0;
+}
+
+int main(void) {
+  struct entry *table = malloc(TABLE_SIZE * sizeof(struct entry));
+  unsigned int checksum = 0;
+  unsigned int round, key;
+
+  for (round = 0; round < ROUNDS; ++round) {
+    memset(table, 0, TABLE_SIZE * sizeof(struct entry));
+
+    for (key = 1; key <= KEYS; ++key) {
+      insert(table, key * 2654435761u + round, key);
+    }
+
+    for (key = 1; key <= KEYS; ++key) {
+      checksum += lookup(table, key * 2654435761u + round);
+      checksum ^= lookup(table, key * 40503u + round);
+    }
+
+    checksum ^= fnv1a((const unsigned char *) table, TABLE_SIZE * sizeof(struct entry));
+  }
+
+  printf("%u\n", checksum);
+  free(table);
+
+  return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Switch-heavy interpreter: a small register machine dispatching through one big switch, which
+ * makes for a fanin node with lots of predecessors.
+ */
+#include <stdio.h>
+
+enum opcode {
+  LOADI, MOV, ADD, SUB, MUL, AND, OR, XOR, SHLI, SHRI, INC, DEC, JZ, JNZ, JMP, HALT
+};
+
+struct instruction {
+  enum opcode op;
+  int dst;
+  int src1;
+  int src2;
+  unsigned long imm;
+};
+
+/* Sums a xorshift sequence until the counter in r0 runs out. */
+static const struct instruction program[] = {
+  { LOADI, 0, 0, 0, 4000000 },
+  { LOADI, 1, 0, 0, 88172645 },
+  { LOADI, 2, 0, 0, 0 },
+  { LOADI, 4, 0, 0, 0xffffffffUL },
+  /* 4: loop */
+  { SHLI, 3, 1, 0, 13 },
+  { XOR, 1, 1, 3, 0 },
+  { SHRI, 3, 1, 0, 7 },
+  { XOR, 1, 1, 3, 0 },
+  { SHLI, 3, 1, 0, 17 },
+  { XOR, 1, 1, 3, 0 },
+  { AND, 1, 1, 4, 0 },
+  { ADD, 2, 2, 1, 0 },
+  { DEC, 0, 0, 0, 0 },
+  { JNZ, 0, 0, 0, 4 },
+  { HALT, 0, 0, 0, 0 }
+};
+
+static unsigned long run(const struct instruction *code) {
+  unsigned long r[8] = { 0 };
+  unsigned long pc = 0;
+
+  for (;;) {
+    const struct instruction *i = &code[pc++];
+
+    switch (i->op) {
+      case LOADI: r[i->dst] = i->imm; break;
+      case MOV: r[i->dst] = r[i->src1]; break;
+      case ADD: r[i->dst] = r[i->src1] + r[i->src2]; break;
+      case SUB: r[i->dst] = r[i->src1] - r[i->src2]; break;
+      case MUL: r[i->dst] = r[i->src1] * r[i->src2]; break;
+      case AND: r[i->dst] = r[i->src1] & r[i->src2]; break;
+      case OR: r[i->dst] = r[i->src1] | r[i->src2]; break;
+      case XOR: r[i->dst] = r[i->src1] ^ r[i->src2]; break;
+      case SHLI: r[i->dst] = r[i->src1] << i->imm; break;
+      case SHRI: r[i->dst] = r[i->src1] >> i->imm; break;
+      case INC: ++r[i->dst]; break;
+      case DEC: --r[i->dst]; break;
+      case JZ: if (!r[i->dst]) pc = i->imm; break;
+      case JNZ: if (r[i->dst]) pc = i->imm; break;
+      case JMP: pc = i->imm; break;
+      case HALT: return r[2];
+    }
+  }
+}
+
+int main(void) {
+  printf("%lu\n", run(program));
+
+  return 0;
+}
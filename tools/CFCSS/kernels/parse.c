@@ -0,0 +1,136 @@
+/*
+ * Parsing: a recursive descent parser and evaluator for arithmetic expressions, generated
+ * deterministically, with many small functions and calls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LENGTH (1 << 20)
+#define ROUNDS 16
+
+static char *input;
+static const char *cursor;
+static size_t position;
+static unsigned int state = 7;
+
+static unsigned int next_random(void) {
+  state = state * 1103515245u + 12345u;
+  return state >> 16;
+}
+
+static void emit(char c) {
+  if (position < LENGTH - 1) {
+    input[position++] = c;
+  }
+}
+
+static void generate(int depth) {
+  unsigned int choice = next_random() % 8;
+
+  if (depth > 12 || choice < 3) {
+    unsigned int number = next_random() % 1000;
+    if (number >= 100) {
+      emit('0' + number / 100);
+    }
+    if (number >= 10) {
+      emit('0' + number / 10 % 10);
+    }
+    emit('0' + number % 10);
+  } else if (choice < 5) {
+    emit('(');
+    generate(depth + 1);
+    emit(')');
+  } else {
+    generate(depth + 1);
+    emit("+-*+"[choice - 5 + next_random() % 2]);
+    generate(depth + 1);
+  }
+}
+
+static long parse_sum(void);
+
+static void skip_spaces(void) {
+  while (*cursor == ' ') {
+    ++cursor;
+  }
+}
+
+static long parse_atom(void) {
+  long value = 0;
+
+  skip_spaces();
+
+  if (*cursor == '(') {
+    ++cursor;
+    value = parse_sum();
+    if (*cursor == ')') {
+      ++cursor;
+    }
+    return value;
+  }
+
+  while (*cursor >= '0' && *cursor <= '9') {
+    value = value * 10 + (*cursor++ - '0');
+  }
+
+  return value;
+}
+
+static long parse_product(void) {
+  long value = parse_atom();
+
+  while (*cursor == '*') {
+    ++cursor;
+    value = (value * parse_atom()) % 1000003;
+  }
+
+  return value;
+}
+
+static long parse_sum(void) {
+  long value = parse_product();
+
+  for (;;) {
+    skip_spaces();
+
+    if (*cursor == '+') {
+      ++cursor;
+      value += parse_product();
+    } else if (*cursor == '-') {
+      ++cursor;
+      value -= parse_product();
+    } else {
+      return value;
+    }
+  }
+}
+
+int main(void) {
+  long checksum = 0;
+  int round;
+
+  input = malloc(LENGTH);
+
+  for (round = 0; round < ROUNDS; ++round) {
+    position = 0;
+    while (position < LENGTH - 64) {
+      generate(0);
+      emit('+');
+    }
+    emit('0');
+    input[position] = '\0';
+
+    cursor = input;
+    while (*cursor) {
+      checksum = checksum * 31 + parse_sum();
+      if (*cursor) {
+        ++cursor;
+      }
+    }
+  }
+
+  printf("%ld\n", checksum);
+  free(input);
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Sorting: quicksort with an insertion sort cutoff over pseudo-random integers, lots of small
+ * loops and data-dependent branches.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COUNT (1 << 18)
+#define ROUNDS 8
+
+static unsigned int state = 1;
+
+static unsigned int next_random(void) {
+  state = state * 1103515245u + 12345u;
+  return state >> 1;
+}
+
+static void insertion_sort(unsigned int *data, int lo, int hi) {
+  int i, j;
+
+  for (i = lo + 1; i <= hi; ++i) {
+    unsigned int value = data[i];
+    for (j = i - 1; j >= lo && data[j] > value; --j) {
+      data[j + 1] = data[j];
+    }
+    data[j + 1] = value;
+  }
+}
+
+static void quicksort(unsigned int *data, int lo, int hi) {
+  while (hi - lo > 16) {
+    unsigned int pivot = data[lo + (hi - lo) / 2];
+    int i = lo, j = hi;
+
+    while (i <= j) {
+      while (data[i] < pivot) {
+        ++i;
+      }
+      while (data[j] > pivot) {
+        --j;
+      }
+      if (i <= j) {
+        unsigned int tmp = data[i];
+        data[i++] = data[j];
+        data[j--] = tmp;
+      }
+    }
+
+    /* Recurse into the smaller half only. */
+    if (j - lo < hi - i) {
+      quicksort(data, lo, j);
+      lo = i;
+    } else {
+      quicksort(data, i, hi);
+      hi = j;
+    }
+  }
+
+  insertion_sort(data, lo, hi);
+}
+
+int main(void) {
+  unsigned int *data = malloc(COUNT * sizeof(unsigned int));
+  unsigned long checksum = 0;
+  int round, i;
+
+  for (round = 0; round < ROUNDS; ++round) {
+    for (i = 0; i < COUNT; ++i) {
+      data[i] = next_random();
+    }
+
+    quicksort(data, 0, COUNT - 1);
+
+    for (i = 0; i < COUNT; i += 1024) {
+      checksum = checksum * 31 + data[i];
+    }
+  }
+
+  printf("%lu\n", checksum);
+  free(data);
+
+  return 0;
+}
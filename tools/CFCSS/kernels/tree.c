@@ -0,0 +1,94 @@
+/*
+ * Recursive traversal: builds binary search trees and walks them recursively, so most of the
+ * control flow goes through calls and returns.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NODES (1 << 16)
+#define ROUNDS 32
+
+struct node {
+  unsigned int key;
+  struct node *left;
+  struct node *right;
+};
+
+static struct node pool[NODES];
+static unsigned int used;
+static unsigned int state = 3;
+
+static unsigned int next_random(void) {
+  state = state * 1103515245u + 12345u;
+  return state >> 1;
+}
+
+static struct node *insert(struct node *root, unsigned int key) {
+  if (!root) {
+    struct node *node = &pool[used++];
+    node->key = key;
+    node->left = node->right = NULL;
+    return node;
+  }
+
+  if (key < root->key) {
+    root->left = insert(root->left, key);
+  } else {
+    root->right = insert(root->right, key);
+  }
+
+  return root;
+}
+
+static unsigned int depth(const struct node *root) {
+  unsigned int left, right;
+
+  if (!root) {
+    return 0;
+  }
+
+  left = depth(root->left);
+  right = depth(root->right);
+
+  return 1 + (left > right ? left : right);
+}
+
+static unsigned long sum_range(const struct node *root, unsigned int lo, unsigned int hi) {
+  if (!root) {
+    return 0;
+  }
+
+  if (root->key < lo) {
+    return sum_range(root->right, lo, hi);
+  }
+
+  if (root->key > hi) {
+    return sum_range(root->left, lo, hi);
+  }
+
+  return root->key + sum_range(root->left, lo, hi) + sum_range(root->right, lo, hi);
+}
+
+int main(void) {
+  unsigned long checksum = 0;
+  int round, i;
+
+  for (round = 0; round < ROUNDS; ++round) {
+    struct node *root = NULL;
+    used = 0;
+
+    for (i = 0; i < NODES; ++i) {
+      root = insert(root, next_random());
+    }
+
+    checksum += depth(root);
+    for (i = 0; i < 256; ++i) {
+      unsigned int lo = next_random();
+      checksum ^= sum_range(root, lo, lo + (1u << 24));
+    }
+  }
+
+  printf("%lu\n", checksum);
+
+  return 0;
+}
@@ -1,9 +1,522 @@
+/*
+ * Runtime overhead benchmark for CFCSS.
+ *
+ * Builds each kernel once without instrumentation and once for every variant, i.e. set of CFCSS
+ * options, runs the binaries and prints one line of CSV per kernel and variant:
+ *
+ *   kernel,variant,options,seconds,slowdown,text_bytes,text_growth,instructions,
+ *   instruction_growth,output_matches
+ *
+ * Slowdown and growth are relative to the plain build of the same kernel. Seconds are the fastest
+ * of all runs, instructions are counted in user space with perf_event_open() and are left empty
+ * if the kernel does not allow that. Output of instrumented kernels is compared against the plain
+ * build, as a cheap check that instrumentation did not change what the kernel computes.
+ *
+ * All builds go through the same pipeline, so that the only difference is instrumentation:
+ *
+ *   clang -O2 -emit-llvm -c kernel.c -o kernel.bc
+ *   opt -load CFCSS.so -instrument-blocks <options> kernel.bc -o kernel.<variant>.bc
+ *   llc -O2 -filetype=obj kernel.<variant>.bc -o kernel.<variant>.o
+ *   clang kernel.<variant>.o -o kernel.<variant>
+ *
+ * Usage:
+ *
+ *   CFCSS -l CFCSS.so [-d kernel-dir] [-w work-dir] [-b llvm-bin-dir] [-n runs]
+ *         [-V name=options]... [kernel]...
+ *
+ * Without -V, a default set of variants covering the main CFCSS options is used.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <linux/perf_event.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#include "CFCSS.h"
+#define MAX_ARGS 64
+#define MAX_VARIANTS 32
+#define MAX_PATH 4096
+#define MAX_OUTPUT 4096
+
+struct variant {
+  const char *name;
+  const char *options;
+};
+
+struct measurement {
+  double seconds;
+  long long instructions;
+  long long text_bytes;
+  char output[MAX_OUTPUT];
+};
+
+static const char *default_kernels[] = { "sort", "hash", "parse", "tree", "interp" };
+
+static const struct variant default_variants[] = {
+  { "cfcss", "" },
+  { "sig32", "-cfcss-signatures-32bit" },
+  { "ssa", "-cfcss-ssa-registers" },
+  { "deferred", "-cfcss-deferred-checks" },
+  { "regions", "-cfcss-merge-regions" },
+  { "sparse", "-cfcss-check-policy=calls,returns,backedges -cfcss-check-interval=8" }
+};
+
+static const char *kernel_dir = "kernels";
+static const char *work_dir = "cfcss-bench";
+static const char *bin_dir = NULL;
+static const char *library = NULL;
+static int runs = 5;
+
+static struct variant variants[MAX_VARIANTS];
+static int num_variants = 0;
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s -l CFCSS.so [-d kernel-dir] [-w work-dir] [-b llvm-bin-dir] "
+      "[-n runs] [-V name=options]... [kernel]...\n", program);
+  exit(2);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Resolve an LLVM tool against -b if given, and against PATH otherwise.
+ */
+static const char *tool(const char *name) {
+  static char paths[4][MAX_PATH];
+  static int next = 0;
+  char *path;
+
+  if (!bin_dir) {
+    return name;
+  }
+
+  path = paths[next++ % 4];
+  snprintf(path, MAX_PATH, "%s/%s", bin_dir, name);
+
+  return path;
+}
+
+/*
+ * Split options at whitespace into argv, in place. Returns the number of arguments added.
+ */
+static int split_options(char *options, char **argv, int max) {
+  int argc = 0;
+  char *token;
+
+  for (token = strtok(options, " \t"); token && argc < max; token = strtok(NULL, " \t")) {
+    argv[argc++] = token;
+  }
+
+  return argc;
+}
+
+static long long open_instruction_counter(pid_t pid) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.inherit = 1;
+
+  return syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+/*
+ * Run argv to completion, with stdout redirected to output_path if given. Fills in wall time and,
+ * if possible, the number of user space instructions retired. Returns the exit status, or -1 if
+ * the command could not be run or was killed.
+ */
+static int run_command(char *const argv[], const char *output_path, struct measurement *m) {
+  int go[2];
+  pid_t child;
+  long long counter;
+  double start;
+  int status;
+  char byte = 0;
+
+  if (pipe(go)) {
+    perror("pipe");
+    return -1;
+  }
+
+  child = fork();
+  if (child < 0) {
+    perror("fork");
+    return -1;
+  }
+
+  if (!child) {
+    /* Wait for the parent to attach the instruction counter before exec'ing. */
+    close(go[1]);
+    if (read(go[0], &byte, 1) != 1) {
+      _exit(127);
+    }
+    close(go[0]);
+
+    if (output_path) {
+      int fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        _exit(127);
+      }
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+    }
+
+    execvp(argv[0], argv);
+    fprintf(stderr, "exec %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+
+  close(go[0]);
+
+  counter = m ? open_instruction_counter(child) : -1;
+
+  start = now();
+  if (write(go[1], &byte, 1) != 1) {
+    perror("write");
+  }
+  close(go[1]);
+
+  while (waitpid(child, &status, 0) < 0) {
+    if (errno != EINTR) {
+      perror("waitpid");
+      return -1;
+    }
+  }
+
+  if (m) {
+    m->seconds = now() - start;
+    m->instructions = -1;
+
+    if (counter >= 0) {
+      long long count;
+      if (read(counter, &count, sizeof(count)) == sizeof(count)) {
+        m->instructions = count;
+      }
+      close(counter);
+    }
+  }
+
+  if (!WIFEXITED(status)) {
+    return -1;
+  }
+
+  return WEXITSTATUS(status);
+}
+
+/*
+ * Build a command line from a fixed prefix and whitespace-separated options and run it.
+ */
+static int build(const char *step, char **prefix, int prefix_length, const char *options,
+    char **suffix) {
+
+  char *argv[MAX_ARGS];
+  char buffer[MAX_PATH];
+  int argc = 0;
+  int i;
+
+  for (i = 0; i < prefix_length; ++i) {
+    argv[argc++] = prefix[i];
+  }
+
+  if (options) {
+    snprintf(buffer, sizeof(buffer), "%s", options);
+    argc += split_options(buffer, argv + argc, MAX_ARGS - argc - 8);
+  }
+
+  for (i = 0; suffix[i]; ++i) {
+    argv[argc++] = suffix[i];
+  }
+  argv[argc] = NULL;
+
+  if (run_command(argv, NULL, NULL)) {
+    fprintf(stderr, "%s failed:", step);
+    for (i = 0; i < argc; ++i) {
+      fprintf(stderr, " %s", argv[i]);
+    }
+    fprintf(stderr, "\n");
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Sum up the sizes of all executable sections of an ELF64 file, -1 if it is anything else.
+ */
+static long long text_size(const char *path) {
+  FILE *file = fopen(path, "rb");
+  Elf64_Ehdr header;
+  Elf64_Shdr section;
+  long long size = 0;
+  int i;
+
+  if (!file) {
+    return -1;
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1
+      || memcmp(header.e_ident, ELFMAG, SELFMAG)
+      || header.e_ident[EI_CLASS] != ELFCLASS64) {
+
+    fclose(file);
+    return -1;
+  }
+
+  for (i = 0; i < header.e_shnum; ++i) {
+    if (fseek(file, header.e_shoff + (long) i * header.e_shentsize, SEEK_SET)
+        || fread(&section, sizeof(section), 1, file) != 1) {
+
+      fclose(file);
+      return -1;
+    }
+
+    if (section.sh_flags & SHF_EXECINSTR) {
+      size += section.sh_size;
+    }
+  }
+
+  fclose(file);
+
+  return size;
+}
+
+static void read_output(const char *path, char *output) {
+  FILE *file = fopen(path, "r");
+  size_t length = 0;
+
+  if (file) {
+    length = fread(output, 1, MAX_OUTPUT - 1, file);
+    fclose(file);
+  }
+
+  output[length] = '\0';
+}
+
+/*
+ * Compile the kernel to bitcode once, shared by all variants.
+ */
+static int compile_kernel(const char *kernel) {
+  char source[MAX_PATH], bitcode[MAX_PATH];
+  char *prefix[] = { (char *) tool("clang"), "-O2", "-emit-llvm", "-c" };
+  char *suffix[] = { source, "-o", bitcode, NULL };
+
+  snprintf(source, sizeof(source), "%s/%s.c", kernel_dir, kernel);
+  snprintf(bitcode, sizeof(bitcode), "%s/%s.bc", work_dir, kernel);
+
+  return build("clang", prefix, 4, NULL, suffix);
+}
+
+/*
+ * Instrument (unless variant is NULL), link and run the kernel, keeping the fastest run.
+ */
+static int measure(const char *kernel, const struct variant *variant, struct measurement *m) {
+  const char *name = variant ? variant->name : "plain";
+  char bitcode[MAX_PATH], instrumented[MAX_PATH], object[MAX_PATH], binary[MAX_PATH];
+  char output[MAX_PATH];
+  char *run_argv[] = { binary, NULL };
+  int i;
+
+  snprintf(bitcode, sizeof(bitcode), "%s/%s.bc", work_dir, kernel);
+  snprintf(instrumented, sizeof(instrumented), "%s/%s.%s.bc", work_dir, kernel, name);
+  snprintf(object, sizeof(object), "%s/%s.%s.o", work_dir, kernel, name);
+  snprintf(binary, sizeof(binary), "%s/%s.%s", work_dir, kernel, name);
+  snprintf(output, sizeof(output), "%s/%s.%s.out", work_dir, kernel, name);
+
+  if (variant) {
+    char *prefix[] = { (char *) tool("opt"), "-load", (char *) library, "-instrument-blocks" };
+    char *suffix[] = { bitcode, "-o", instrumented, NULL };
+
+    if (build("opt", prefix, 4, variant->options, suffix)) {
+      return -1;
+    }
+  } else {
+    snprintf(instrumented, sizeof(instrumented), "%s", bitcode);
+  }
+
+  {
+    char *prefix[] = { (char *) tool("llc"), "-O2", "-filetype=obj" };
+    char *suffix[] = { instrumented, "-o", object, NULL };
+
+    if (build("llc", prefix, 3, NULL, suffix)) {
+      return -1;
+    }
+  }
+
+  {
+    char *prefix[] = { (char *) tool("clang") };
+    char *suffix[] = { object, "-o", binary, NULL };
+
+    if (build("clang", prefix, 1, NULL, suffix)) {
+      return -1;
+    }
+  }
+
+  m->text_bytes = text_size(binary);
+
+  for (i = 0; i < runs; ++i) {
+    struct measurement run;
+
+    if (run_command(run_argv, output, &run)) {
+      fprintf(stderr, "%s failed.\n", binary);
+      return -1;
+    }
+
+    /* Instructions retired do not depend on the run, only time does. */
+    if (!i || run.seconds < m->seconds) {
+      m->seconds = run.seconds;
+    }
+    if (!i) {
+      m->instructions = run.instructions;
+    }
+  }
+
+  read_output(output, m->output);
+
+  return 0;
+}
+
+static void print_ratio(long long value, long long baseline) {
+  if (value >= 0 && baseline > 0) {
+    printf(",%lld,%.4f", value, (double) value / baseline);
+  } else {
+    printf(",,");
+  }
+}
+
+static void report(const char *kernel, const struct variant *variant,
+    const struct measurement *m, const struct measurement *plain) {
+
+  printf("%s,%s,\"%s\",%.6f,%.4f", kernel, variant ? variant->name : "plain",
+      variant ? variant->options : "", m->seconds,
+      plain->seconds > 0 ? m->seconds / plain->seconds : 0.0);
+
+  print_ratio(m->text_bytes, plain->text_bytes);
+  print_ratio(m->instructions, plain->instructions);
+
+  printf(",%s\n", strcmp(m->output, plain->output) ? "no" : "yes");
+  fflush(stdout);
+}
+
+static int run_kernel(const char *kernel) {
+  struct measurement plain, instrumented;
+  int result = 0;
+  int i;
+
+  if (compile_kernel(kernel) || measure(kernel, NULL, &plain)) {
+    fprintf(stderr, "Skipping %s.\n", kernel);
+    return -1;
+  }
+
+  report(kernel, NULL, &plain, &plain);
+
+  for (i = 0; i < num_variants; ++i) {
+    if (measure(kernel, &variants[i], &instrumented)) {
+      result = -1;
+      continue;
+    }
+
+    report(kernel, &variants[i], &instrumented, &plain);
+
+    if (strcmp(instrumented.output, plain.output)) {
+      result = -1;
+    }
+  }
+
+  return result;
+}
 
 int main(int argc, char **argv) {
+  int result = 0;
+  int option;
+  int i;
+
+  while ((option = getopt(argc, argv, "b:d:l:n:w:V:")) != -1) {
+    switch (option) {
+      case 'b':
+        bin_dir = optarg;
+        break;
+      case 'd':
+        kernel_dir = optarg;
+        break;
+      case 'l':
+        library = optarg;
+        break;
+      case 'n':
+        runs = atoi(optarg);
+        break;
+      case 'w':
+        work_dir = optarg;
+        break;
+      case 'V': {
+        char *separator = strchr(optarg, '=');
+
+        if (num_variants == MAX_VARIANTS) {
+          fprintf(stderr, "Too many variants.\n");
+          return 2;
+        }
+
+        if (separator) {
+          *separator = '\0';
+          variants[num_variants].options = separator + 1;
+        } else {
+          variants[num_variants].options = "";
+        }
+        variants[num_variants++].name = optarg;
+        break;
+      }
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (!library || runs < 1) {
+    usage(argv[0]);
+  }
+
+  if (!num_variants) {
+    num_variants = sizeof(default_variants) / sizeof(default_variants[0]);
+    memcpy(variants, default_variants, sizeof(default_variants));
+  }
+
+  if (mkdir(work_dir, 0755) && errno != EEXIST) {
+    perror(work_dir);
+    return 1;
+  }
+
+  printf("kernel,variant,options,seconds,slowdown,text_bytes,text_growth,instructions,"
+      "instruction_growth,output_matches\n");
+
+  if (optind < argc) {
+    for (i = optind; i < argc; ++i) {
+      result |= run_kernel(argv[i]);
+    }
+  } else {
+    for (i = 0; i < (int) (sizeof(default_kernels) / sizeof(default_kernels[0])); ++i) {
+      result |= run_kernel(default_kernels[i]);
+    }
+  }
+
+  return result ? 1 : 0;
 }
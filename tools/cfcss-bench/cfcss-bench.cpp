@@ -0,0 +1,528 @@
+//===- cfcss-bench.cpp - Compile-time scaling benchmark for CFCSS ---------===//
+//
+// Generates synthetic modules that stress individual CFCSS passes and runs the passes on them,
+// reporting wall time and peak RSS after each pass as CSV. Every scenario and size runs in a
+// process of its own, and the peak RSS reported for a pass is the high-water mark since the
+// previous pass, reset through /proc/self/clear_refs. It includes the memory still held from
+// earlier passes, so growth of the peak across sizes is what shows superlinear passes.
+//
+// Usage:
+//
+//   cfcss-bench -load=CFCSS.so [-scenario=switch,...] [-sizes=1000,10000,...] [-verify]
+//   cfcss-bench -load=CFCSS.so -scenario=blocks -sizes=100000 -emit | opt ...
+//
+// Time spent in analyses that are scheduled implicitly, like the call graph, counts towards the
+// next CFCSS pass. Comparing the time per block across sizes shows superlinear behaviour.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/Verifier.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+namespace {
+
+  enum Scenario {
+    SwitchFanOut,
+    ManyCalls,
+    CallGraph,
+    ManyBlocks
+  };
+
+  static cl::list<Scenario> Scenarios("scenario",
+      cl::CommaSeparated,
+      cl::desc("Scenarios to run. The default is to run all of them."),
+      cl::values(
+          clEnumValN(SwitchFanOut, "switch",
+              "Switches with overlapping fanin targets, for RemoveCFGAliasing (size: cases)"),
+          clEnumValN(ManyCalls, "calls",
+              "Straight-line code full of calls, for SplitAfterCall (size: calls)"),
+          clEnumValN(CallGraph, "callgraph",
+              "Deep and wide call graphs of external functions, for GatewayFunctions "
+              "(size: functions)"),
+          clEnumValN(ManyBlocks, "blocks",
+              "Lots of conditional branches, for AssignBlockSignatures (size: basic blocks)"),
+          clEnumValEnd));
+
+  static cl::list<unsigned> Sizes("sizes",
+      cl::CommaSeparated,
+      cl::desc("Sizes to generate for each scenario. Each scenario has its own defaults."));
+
+  static cl::opt<bool> Emit("emit",
+      cl::desc("Print the module generated for the first scenario and size instead of running "
+          "any passes."));
+
+  static cl::opt<bool> Verify("verify",
+      cl::desc("Verify the instrumented module, not included in the measurements."));
+
+  /**
+   * CFCSS passes in the order they are scheduled in when InstrumentBasicBlocks is requested.
+   */
+  static const char *PassNames[] = {
+    "gateway-functions",
+    "instruction-index",
+    "split-after-call",
+    "remove-cfg-aliasing",
+    "signature-regions",
+    "assign-block-signatures",
+    "instrument-blocks"
+  };
+
+  // Basic blocks per function in the blocks scenario, so that it scales with the module and not
+  // just with a single function.
+  static const unsigned int BlocksPerFunction = 10000;
+
+  /**
+   * Reset the high-water mark of our RSS to the current RSS, so that the next getPeakRSS() only
+   * covers what happened in between. Needs Linux 4.0 or later.
+   */
+  void resetPeakRSS() {
+    FILE *clearRefs = fopen("/proc/self/clear_refs", "w");
+    if (clearRefs) {
+      fputs("5", clearRefs);
+      fclose(clearRefs);
+    }
+  }
+
+  /**
+   * Get the peak RSS in kilobytes since the last resetPeakRSS(). Without /proc, this falls back to
+   * the peak of the whole process.
+   */
+  long getPeakRSS() {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status) {
+      char line[256];
+      long peak = -1;
+      while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) {
+          break;
+        }
+      }
+      fclose(status);
+
+      if (peak >= 0) {
+        return peak;
+      }
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Kilobytes on Linux.
+    return usage.ru_maxrss;
+  }
+
+  double getWallTime() {
+    return TimeRecord::getCurrentTime(true).getWallTime();
+  }
+
+  uint64_t countBlocks(Module &M) {
+    uint64_t numBlocks = 0;
+    for (Module::iterator fi = M.begin(), fe = M.end(); fi != fe; ++fi) {
+      numBlocks += fi->size();
+    }
+
+    return numBlocks;
+  }
+
+  /**
+   * Prints one line of CSV whenever it runs, with the time since the last one.
+   */
+  class Probe : public ModulePass {
+    public:
+      static char ID;
+
+      Probe() : ModulePass(ID), scenario(NULL), size(0), label(NULL), lastTime(NULL) {}
+
+      Probe(const char *scenario, unsigned int size, const char *label, double *lastTime)
+          : ModulePass(ID), scenario(scenario), size(size), label(label), lastTime(lastTime) {}
+
+      virtual const char* getPassName() const {
+        return "CFCSS Benchmark Probe";
+      }
+
+      virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+        AU.setPreservesAll();
+      }
+
+      virtual bool runOnModule(Module &M) {
+        double now = getWallTime();
+        uint64_t numBlocks = countBlocks(M);
+        double elapsed = now - *lastTime;
+
+        outs() << format("%s,%u,%llu,%s,%.6f,%.3f,%ld\n", scenario, size,
+            (unsigned long long) numBlocks, label, elapsed, elapsed * 1e6 / numBlocks,
+            getPeakRSS());
+        outs().flush();
+
+        // Don't count the time it took us to count, and start over with the peak RSS.
+        resetPeakRSS();
+        *lastTime = getWallTime();
+
+        return false;
+      }
+
+    private:
+      const char *scenario;
+      unsigned int size;
+      const char *label;
+      double *lastTime;
+  };
+
+  char Probe::ID = 0;
+
+  static RegisterPass<Probe> X("cfcss-bench-probe", "CFCSS Benchmark Probe", false, true);
+
+  FunctionType* getUnaryType(LLVMContext &context) {
+    Type *int32 = Type::getInt32Ty(context);
+
+    return FunctionType::get(int32, ArrayRef<Type*>(int32), false);
+  }
+
+  /**
+   * One function switching over its argument. Every case branches to two of size / 4 targets,
+   * so that the targets are fanin nodes sharing some but not all of their predecessors. Every
+   * eighth case shares its block with the previous one, giving parallel edges.
+   */
+  void generateSwitchFanOut(Module &M, unsigned int size) {
+    LLVMContext &context = M.getContext();
+    IRBuilder<> builder(context);
+
+    Function *F = Function::Create(getUnaryType(context), GlobalValue::ExternalLinkage,
+        "dispatch", &M);
+    Value *argument = F->arg_begin();
+
+    BasicBlock *entry = BasicBlock::Create(context, "entry", F);
+    BasicBlock *exit = BasicBlock::Create(context, "exit", F);
+    BasicBlock *defaultBlock = BasicBlock::Create(context, "default", F);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateRet(argument);
+
+    builder.SetInsertPoint(defaultBlock);
+    builder.CreateBr(exit);
+
+    unsigned int numTargets = std::max(2u, size / 4);
+    std::vector<BasicBlock*> targets;
+    for (unsigned int idx = 0; idx < numTargets; ++idx) {
+      BasicBlock *target = BasicBlock::Create(context, "target", F);
+      builder.SetInsertPoint(target);
+      builder.CreateBr(exit);
+      targets.push_back(target);
+    }
+
+    builder.SetInsertPoint(entry);
+    SwitchInst *switchInst = builder.CreateSwitch(argument, defaultBlock, size);
+
+    BasicBlock *caseBlock = NULL;
+    for (unsigned int idx = 0; idx < size; ++idx) {
+      if (!caseBlock || idx % 8 != 7) {
+        caseBlock = BasicBlock::Create(context, "case", F);
+        builder.SetInsertPoint(caseBlock);
+
+        Value *condition = builder.CreateICmpSGT(argument, builder.getInt32(idx));
+        builder.CreateCondBr(condition, targets[idx % numTargets],
+            targets[(idx + 1) % numTargets]);
+      }
+
+      switchInst->addCase(builder.getInt32(idx), caseBlock);
+    }
+  }
+
+  /**
+   * One function calling two internal functions alternately, size times in a row.
+   */
+  void generateManyCalls(Module &M, unsigned int size) {
+    LLVMContext &context = M.getContext();
+    IRBuilder<> builder(context);
+
+    Function *callees[2];
+    for (unsigned int idx = 0; idx < 2; ++idx) {
+      callees[idx] = Function::Create(getUnaryType(context), GlobalValue::InternalLinkage,
+          "callee", &M);
+
+      builder.SetInsertPoint(BasicBlock::Create(context, "entry", callees[idx]));
+      builder.CreateRet(builder.CreateAdd(callees[idx]->arg_begin(), builder.getInt32(idx + 1)));
+    }
+
+    Function *caller = Function::Create(getUnaryType(context), GlobalValue::ExternalLinkage,
+        "caller", &M);
+    builder.SetInsertPoint(BasicBlock::Create(context, "entry", caller));
+
+    Value *value = caller->arg_begin();
+    for (unsigned int idx = 0; idx < size; ++idx) {
+      value = builder.CreateCall(callees[idx % 2], value);
+    }
+
+    builder.CreateRet(value);
+  }
+
+  /**
+   * Externally visible functions forming a binary tree of calls, with chains of 16 functions
+   * calling each other for depth and one pseudo-random call further down for width.
+   */
+  void generateCallGraph(Module &M, unsigned int size) {
+    LLVMContext &context = M.getContext();
+    IRBuilder<> builder(context);
+
+    std::vector<Function*> functions;
+    for (unsigned int idx = 0; idx < size; ++idx) {
+      functions.push_back(Function::Create(getUnaryType(context), GlobalValue::ExternalLinkage,
+          "function", &M));
+    }
+
+    for (unsigned int idx = 0; idx < size; ++idx) {
+      Function *F = functions[idx];
+      builder.SetInsertPoint(BasicBlock::Create(context, "entry", F));
+
+      SmallVector<unsigned int, 4> callees;
+      callees.push_back(2 * idx + 1);
+      callees.push_back(2 * idx + 2);
+
+      if (idx % 16 != 15) {
+        callees.push_back(idx + 1);
+      }
+
+      // Only ever call functions with a higher index, which keeps the call graph acyclic.
+      unsigned int random = (uint64_t(idx) * 7919 + 13) % size;
+      if (random > idx) {
+        callees.push_back(random);
+      }
+
+      Value *value = F->arg_begin();
+      for (SmallVectorImpl<unsigned int>::iterator ci = callees.begin(), ce = callees.end();
+          ci != ce; ++ci) {
+
+        if (*ci < size) {
+          value = builder.CreateCall(functions[*ci], value);
+        }
+      }
+
+      builder.CreateRet(value);
+    }
+  }
+
+  /**
+   * Functions of up to BlocksPerFunction basic blocks, each of which branches to one of the next
+   * two blocks.
+   */
+  void generateManyBlocks(Module &M, unsigned int size) {
+    LLVMContext &context = M.getContext();
+    IRBuilder<> builder(context);
+
+    for (unsigned int remaining = size; remaining > 0;) {
+      unsigned int numBlocks = std::max(2u, std::min(remaining, BlocksPerFunction));
+      remaining -= std::min(remaining, numBlocks);
+
+      Function *F = Function::Create(getUnaryType(context), GlobalValue::ExternalLinkage,
+          "blocks", &M);
+      Value *argument = F->arg_begin();
+
+      std::vector<BasicBlock*> blocks;
+      for (unsigned int idx = 0; idx < numBlocks; ++idx) {
+        blocks.push_back(BasicBlock::Create(context, "block", F));
+      }
+
+      for (unsigned int idx = 0; idx + 1 < numBlocks; ++idx) {
+        builder.SetInsertPoint(blocks[idx]);
+
+        Value *condition = builder.CreateICmpSLT(argument, builder.getInt32(idx));
+        builder.CreateCondBr(condition, blocks[idx + 1],
+            blocks[std::min(idx + 2, numBlocks - 1)]);
+      }
+
+      builder.SetInsertPoint(blocks.back());
+      builder.CreateRet(argument);
+    }
+  }
+
+  const char* getScenarioName(Scenario scenario) {
+    switch (scenario) {
+      case SwitchFanOut: return "switch";
+      case ManyCalls: return "calls";
+      case CallGraph: return "callgraph";
+      case ManyBlocks: return "blocks";
+    }
+
+    llvm_unreachable("Unknown scenario");
+  }
+
+  std::vector<unsigned int> getDefaultSizes(Scenario scenario) {
+    static const unsigned int switchSizes[] = { 1000, 4000, 16000, 64000 };
+    static const unsigned int callSizes[] = { 1000, 10000, 100000 };
+    static const unsigned int blockSizes[] = { 10000, 100000, 1000000 };
+
+    switch (scenario) {
+      case SwitchFanOut:
+        return std::vector<unsigned int>(switchSizes, switchSizes + 4);
+      case ManyCalls:
+      case CallGraph:
+        return std::vector<unsigned int>(callSizes, callSizes + 3);
+      case ManyBlocks:
+        return std::vector<unsigned int>(blockSizes, blockSizes + 3);
+    }
+
+    llvm_unreachable("Unknown scenario");
+  }
+
+  Module* generate(LLVMContext &context, Scenario scenario, unsigned int size) {
+    Module *M = new Module(std::string("cfcss-bench-") + getScenarioName(scenario), context);
+
+    switch (scenario) {
+      case SwitchFanOut: generateSwitchFanOut(*M, size); break;
+      case ManyCalls: generateManyCalls(*M, size); break;
+      case CallGraph: generateCallGraph(*M, size); break;
+      case ManyBlocks: generateManyBlocks(*M, size); break;
+    }
+
+    return M;
+  }
+
+  /**
+   * Generate and instrument a single module, printing a line of CSV after each step.
+   */
+  int run(Scenario scenario, unsigned int size) {
+    const char *scenarioName = getScenarioName(scenario);
+    PassRegistry &registry = *PassRegistry::getPassRegistry();
+
+    LLVMContext context;
+    resetPeakRSS();
+    double lastTime = getWallTime();
+
+    OwningPtr<Module> M(generate(context, scenario, size));
+
+    PassManager PM;
+    PM.add(new Probe(scenarioName, size, "generate", &lastTime));
+
+    for (unsigned int idx = 0; idx < array_lengthof(PassNames); ++idx) {
+      const PassInfo *passInfo = registry.getPassInfo(PassNames[idx]);
+      if (!passInfo) {
+        errs() << "cfcss-bench: unknown pass [" << PassNames[idx] << "], load the CFCSS library "
+            << "with -load.\n";
+        return 1;
+      }
+
+      PM.add(passInfo->createPass());
+      PM.add(new Probe(scenarioName, size, PassNames[idx], &lastTime));
+    }
+
+    if (Verify) {
+      PM.add(createVerifierPass());
+    }
+
+    PM.run(*M);
+
+    return 0;
+  }
+
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &registry = *PassRegistry::getPassRegistry();
+  initializeCore(registry);
+  initializeAnalysis(registry);
+  initializeIPA(registry);
+  initializeIPO(registry);
+  initializeTransformUtils(registry);
+  initializeScalarOpts(registry);
+
+  cl::ParseCommandLineOptions(argc, argv, "CFCSS compile-time benchmark\n");
+
+  std::vector<Scenario> scenarios(Scenarios.begin(), Scenarios.end());
+  if (scenarios.empty()) {
+    scenarios.push_back(SwitchFanOut);
+    scenarios.push_back(ManyCalls);
+    scenarios.push_back(CallGraph);
+    scenarios.push_back(ManyBlocks);
+  }
+
+  if (Emit) {
+    std::vector<unsigned int> sizes(Sizes.begin(), Sizes.end());
+    if (sizes.empty()) {
+      sizes = getDefaultSizes(scenarios.front());
+    }
+
+    LLVMContext context;
+    OwningPtr<Module> M(generate(context, scenarios.front(), sizes.front()));
+    M->print(outs(), NULL);
+
+    return 0;
+  }
+
+  outs() << "scenario,size,blocks,pass,seconds,us_per_block,peak_rss_kb\n";
+  outs().flush();
+
+  int result = 0;
+
+  for (std::vector<Scenario>::iterator si = scenarios.begin(), se = scenarios.end(); si != se;
+      ++si) {
+
+    std::vector<unsigned int> sizes(Sizes.begin(), Sizes.end());
+    if (sizes.empty()) {
+      sizes = getDefaultSizes(*si);
+    }
+
+    for (std::vector<unsigned int>::iterator zi = sizes.begin(), ze = sizes.end(); zi != ze;
+        ++zi) {
+
+      // A fresh process for every run keeps peak RSS meaningful.
+      pid_t child = fork();
+      if (child < 0) {
+        errs() << "cfcss-bench: fork() failed.\n";
+        return 1;
+      }
+
+      if (!child) {
+        int childResult = run(*si, *zi);
+        outs().flush();
+        _exit(childResult);
+      }
+
+      int status = 0;
+      waitpid(child, &status, 0);
+
+      if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        errs() << "cfcss-bench: " << getScenarioName(*si) << " at size " << *zi << " failed.\n";
+        result = 1;
+      }
+    }
+  }
+
+  return result;
+}
@@ -0,0 +1,987 @@
+/*
+ * Fault injection campaigns against CFCSS-instrumented binaries.
+ *
+ * Starting a process for every injected fault spends most of the time in exec and the dynamic
+ * loader, so each worker starts the target once under ptrace, runs it to a snapshot point (main by
+ * default) and from there on makes the stopped target fork() for every trial. The forked child
+ * shares the snapshot copy-on-write, gets a fault injected at a random dynamic point and runs on
+ * to see whether the fault is caught.
+ *
+ * Fault models, all injected at the entry of a randomly chosen function on a random one of its
+ * first -h invocations:
+ *
+ *   branch    jump to a random address inside a random function instead of entering this one
+ *   return    overwrite the return address with a random address inside a random function
+ *   gsr       flip a random bit of interFunctionGSR
+ *   register  flip a random bit of a random general purpose register
+ *
+ * Each trial ends up as one of
+ *
+ *   not_activated  the chosen function was entered less often than chosen, no fault injected
+ *   masked         exited with the same status and output as the fault-free run
+ *   detected       trapped in cfcss.handleSignatureFault, or entered the fault hook
+ *                  cfcss_signature_fault of binaries instrumented with -cfcss-fault-hook
+ *   crashed        killed by any other signal
+ *   hung           did not finish in time
+ *   corrupted      exited with a different status or output, i.e. silent data corruption
+ *
+ * and coverage is detected / (detected + crashed + hung + corrupted). Binaries are given as
+ * name=path, typically one per set of CFCSS options, e.g. those that the CFCSS benchmark harness
+ * leaves in its work directory:
+ *
+ *   cfcss-inject -n 10000 plain=bench/sort.plain cfcss=bench/sort.cfcss sig32=bench/sort.sig32
+ *
+ * Only x86-64 Linux is supported.
+ */
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_BINARIES 32
+#define MAX_PATH 4096
+
+#define HANDLER_NAME "cfcss.handleSignatureFault"
+#define HOOK_NAME "cfcss_signature_fault"
+#define GSR_PREFIX "interFunctionGSR"
+
+enum fault {
+  FAULT_BRANCH,
+  FAULT_RETURN,
+  FAULT_GSR,
+  FAULT_REGISTER,
+  NUM_FAULTS
+};
+
+static const char *fault_names[NUM_FAULTS] = { "branch", "return", "gsr", "register" };
+
+enum outcome {
+  NOT_ACTIVATED,
+  MASKED,
+  DETECTED,
+  CRASHED,
+  HUNG,
+  CORRUPTED,
+  NUM_OUTCOMES
+};
+
+struct counts {
+  long outcomes[NUM_OUTCOMES];
+};
+
+struct function {
+  char *name;
+  uint64_t start;
+  uint64_t size;
+};
+
+/*
+ * What we need to know about the target, with addresses as in the ELF file.
+ */
+struct image {
+  const char *name;
+  const char *path;
+  int relocatable;
+
+  struct function *functions;
+  int num_functions;
+
+  uint64_t snapshot;
+  uint64_t handler_start;
+  uint64_t handler_end;
+
+  /* Entry of the fault hook from the CFCSS runtime, 0 if not linked in. */
+  uint64_t hook;
+
+  /* Offset of interFunctionGSR into the TLS block of the executable, and its size in bytes. */
+  int has_gsr;
+  uint64_t gsr_offset;
+  uint64_t gsr_size;
+  uint64_t tls_block_size;
+};
+
+/*
+ * struct sigaction as the kernel takes it for rt_sigaction.
+ */
+struct kernel_sigaction {
+  uint64_t handler;
+  uint64_t flags;
+  uint64_t restorer;
+  uint64_t mask;
+};
+
+/*
+ * A target stopped at the snapshot point, with its load base.
+ */
+struct snapshot {
+  pid_t pid;
+  uint64_t base;
+  struct user_regs_struct regs;
+  /* The disposition of SIGCHLD in the target, before the snapshot started ignoring it. */
+  struct kernel_sigaction sigchld;
+};
+
+static long num_trials = 1000;
+static int num_jobs = 0;
+static int max_hits = 16;
+static long timeout_ms = 0;
+static unsigned long seed = 1;
+static const char *snapshot_symbol = "main";
+static int faults_enabled[NUM_FAULTS] = { 1, 1, 1, 1 };
+
+static volatile sig_atomic_t timed_out = 0;
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s [-n trials] [-j jobs] [-m branch,return,gsr,register] [-h max-hits] "
+      "[-t timeout-ms] [-s snapshot-symbol] [-S seed] name=binary...\n", program);
+  exit(2);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  uint64_t x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+
+  return *state = x;
+}
+
+/*
+ * ELF
+ */
+
+static void *read_file(const char *path, size_t *size) {
+  FILE *file = fopen(path, "rb");
+  char *data;
+  long length;
+
+  if (!file) {
+    return NULL;
+  }
+
+  fseek(file, 0, SEEK_END);
+  length = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  data = malloc(length);
+  if (fread(data, 1, length, file) != (size_t) length) {
+    free(data);
+    data = NULL;
+  }
+
+  fclose(file);
+  *size = length;
+
+  return data;
+}
+
+/*
+ * Functions that belong to the C runtime rather than to the program, which we don't inject into.
+ */
+static int is_runtime_function(const char *name) {
+  return name[0] == '_'
+      || !strcmp(name, "frame_dummy")
+      || !strcmp(name, "register_tm_clones")
+      || !strcmp(name, "deregister_tm_clones");
+}
+
+static int load_image(struct image *image) {
+  size_t size;
+  char *data = read_file(image->path, &size);
+  Elf64_Ehdr *header = (Elf64_Ehdr *) data;
+  Elf64_Shdr *sections;
+  Elf64_Phdr *segments;
+  int found_snapshot = 0;
+  int i;
+
+  if (!data || size < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG)
+      || header->e_ident[EI_CLASS] != ELFCLASS64 || header->e_machine != EM_X86_64) {
+
+    fprintf(stderr, "%s: not an x86-64 ELF file.\n", image->path);
+    return -1;
+  }
+
+  image->relocatable = header->e_type == ET_DYN;
+
+  segments = (Elf64_Phdr *) (data + header->e_phoff);
+  for (i = 0; i < header->e_phnum; ++i) {
+    if (segments[i].p_type == PT_TLS) {
+      uint64_t align = segments[i].p_align ? segments[i].p_align : 1;
+      image->tls_block_size = (segments[i].p_memsz + align - 1) & ~(align - 1);
+    }
+  }
+
+  sections = (Elf64_Shdr *) (data + header->e_shoff);
+  for (i = 0; i < header->e_shnum; ++i) {
+    Elf64_Sym *symbols;
+    const char *strings;
+    size_t j, count;
+
+    if (sections[i].sh_type != SHT_SYMTAB) {
+      continue;
+    }
+
+    symbols = (Elf64_Sym *) (data + sections[i].sh_offset);
+    strings = data + sections[sections[i].sh_link].sh_offset;
+    count = sections[i].sh_size / sizeof(Elf64_Sym);
+
+    image->functions = calloc(count, sizeof(struct function));
+
+    for (j = 0; j < count; ++j) {
+      const char *name = strings + symbols[j].st_name;
+      int type = ELF64_ST_TYPE(symbols[j].st_info);
+
+      if (symbols[j].st_shndx == SHN_UNDEF) {
+        continue;
+      }
+
+      if (type == STT_TLS && !strncmp(name, GSR_PREFIX, strlen(GSR_PREFIX))) {
+        image->has_gsr = 1;
+        image->gsr_offset = symbols[j].st_value;
+        image->gsr_size = symbols[j].st_size ? symbols[j].st_size : 8;
+        continue;
+      }
+
+      if (type != STT_FUNC || !symbols[j].st_size) {
+        continue;
+      }
+
+      if (!strcmp(name, snapshot_symbol)) {
+        image->snapshot = symbols[j].st_value;
+        found_snapshot = 1;
+      }
+
+      if (!strcmp(name, HANDLER_NAME)) {
+        image->handler_start = symbols[j].st_value;
+        image->handler_end = symbols[j].st_value + symbols[j].st_size;
+        continue;
+      }
+
+      if (!strcmp(name, HOOK_NAME)) {
+        image->hook = symbols[j].st_value;
+        continue;
+      }
+
+      if (!is_runtime_function(name)) {
+        struct function *function = &image->functions[image->num_functions++];
+
+        function->name = strdup(name);
+        function->start = symbols[j].st_value;
+        function->size = symbols[j].st_size;
+      }
+    }
+  }
+
+  free(data);
+
+  if (!found_snapshot) {
+    fprintf(stderr, "%s: no symbol [%s] to take the snapshot at, is it stripped?\n", image->path,
+        snapshot_symbol);
+    return -1;
+  }
+
+  if (!image->num_functions) {
+    fprintf(stderr, "%s: no functions to inject faults into.\n", image->path);
+    return -1;
+  }
+
+  if (!image->handler_end && !image->hook) {
+    fprintf(stderr, "%s: neither %s nor %s, faults can not be detected.\n", image->path,
+        HANDLER_NAME, HOOK_NAME);
+  }
+
+  return 0;
+}
+
+/*
+ * ptrace helpers
+ */
+
+static int wait_for(pid_t pid, int *status) {
+  while (waitpid(pid, status, __WALL) < 0) {
+    if (errno != EINTR || timed_out) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static uint64_t peek(pid_t pid, uint64_t address) {
+  return ptrace(PTRACE_PEEKDATA, pid, (void *) address, NULL);
+}
+
+static void poke(pid_t pid, uint64_t address, uint64_t word) {
+  ptrace(PTRACE_POKEDATA, pid, (void *) address, (void *) word);
+}
+
+static void get_regs(pid_t pid, struct user_regs_struct *regs) {
+  ptrace(PTRACE_GETREGS, pid, NULL, regs);
+}
+
+static void set_regs(pid_t pid, struct user_regs_struct *regs) {
+  ptrace(PTRACE_SETREGS, pid, NULL, regs);
+}
+
+static void write_memory(pid_t pid, uint64_t address, const void *data, size_t length) {
+  size_t offset;
+
+  for (offset = 0; offset < length; offset += 8) {
+    uint64_t word = 0;
+    memcpy(&word, (const char *) data + offset, length - offset < 8 ? length - offset : 8);
+    poke(pid, address + offset, word);
+  }
+}
+
+static uint64_t set_breakpoint(pid_t pid, uint64_t address) {
+  uint64_t word = peek(pid, address);
+  poke(pid, address, (word & ~(uint64_t) 0xff) | 0xcc);
+
+  return word;
+}
+
+/*
+ * Make a stopped tracee execute a single system call at its current instruction pointer and
+ * restore it afterwards. If the call is fork(), the new child is returned in forked, stopped and
+ * with the syscall instruction still in its copy of the text.
+ */
+static long inject_syscall(pid_t pid, long number, uint64_t a1, uint64_t a2, uint64_t a3,
+    uint64_t a4, pid_t *forked) {
+
+  struct user_regs_struct saved, regs;
+  uint64_t word;
+  int status;
+
+  get_regs(pid, &saved);
+  word = peek(pid, saved.rip);
+
+  /* syscall is 0f 05. */
+  poke(pid, saved.rip, (word & ~(uint64_t) 0xffff) | 0x050f);
+
+  regs = saved;
+  regs.rax = number;
+  regs.rdi = a1;
+  regs.rsi = a2;
+  regs.rdx = a3;
+  regs.r10 = a4;
+  set_regs(pid, &regs);
+
+  for (;;) {
+    ptrace(PTRACE_SINGLESTEP, pid, NULL, NULL);
+    if (wait_for(pid, &status) || !WIFSTOPPED(status)) {
+      return -1;
+    }
+
+    if (forked && status >> 8 == (SIGTRAP | (PTRACE_EVENT_FORK << 8))) {
+      unsigned long message;
+      ptrace(PTRACE_GETEVENTMSG, pid, NULL, &message);
+      *forked = message;
+      continue;
+    }
+
+    if (WSTOPSIG(status) == SIGTRAP) {
+      break;
+    }
+  }
+
+  get_regs(pid, &regs);
+
+  poke(pid, saved.rip, word);
+  set_regs(pid, &saved);
+
+  if (forked) {
+    /* The child reports its initial stop once the fork completes, and still has the syscall. */
+    wait_for(*forked, &status);
+    poke(*forked, saved.rip, word);
+    set_regs(*forked, &saved);
+  }
+
+  return regs.rax;
+}
+
+static uint64_t find_base(pid_t pid, const struct image *image) {
+  char path[64], line[MAX_PATH + 128];
+  uint64_t base = 0;
+  FILE *maps;
+
+  if (!image->relocatable) {
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  maps = fopen(path, "r");
+  if (!maps) {
+    return 0;
+  }
+
+  /* The first mapping is the executable at file offset 0. */
+  if (fgets(line, sizeof(line), maps)) {
+    base = strtoull(line, NULL, 16);
+  }
+
+  fclose(maps);
+
+  return base;
+}
+
+/*
+ * Start the target under ptrace and run it up to the entry of the snapshot symbol.
+ */
+static int take_snapshot(const struct image *image, struct snapshot *snapshot) {
+  struct kernel_sigaction ignore = { (uint64_t) SIG_IGN, 0, 0, 0 };
+  uint64_t address, word, scratch;
+  size_t offset;
+  int status;
+  pid_t pid;
+
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+
+  if (!pid) {
+    int null = open("/dev/null", O_RDWR);
+
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    execl(image->path, image->path, (char *) NULL);
+    _exit(127);
+  }
+
+  /* Stopped after exec. */
+  if (wait_for(pid, &status) || !WIFSTOPPED(status)) {
+    fprintf(stderr, "%s: could not start.\n", image->path);
+    return -1;
+  }
+
+  ptrace(PTRACE_SETOPTIONS, pid, NULL,
+      (void *) (long) (PTRACE_O_TRACEFORK | PTRACE_O_EXITKILL));
+
+  snapshot->pid = pid;
+  snapshot->base = find_base(pid, image);
+
+  address = snapshot->base + image->snapshot;
+  word = set_breakpoint(pid, address);
+
+  ptrace(PTRACE_CONT, pid, NULL, NULL);
+  if (wait_for(pid, &status) || !WIFSTOPPED(status) || WSTOPSIG(status) != SIGTRAP) {
+    fprintf(stderr, "%s: did not reach [%s].\n", image->path, snapshot_symbol);
+    kill(pid, SIGKILL);
+    return -1;
+  }
+
+  poke(pid, address, word);
+  get_regs(pid, &snapshot->regs);
+  snapshot->regs.rip = address;
+  set_regs(pid, &snapshot->regs);
+
+  /*
+   * The snapshot never runs again and so never waits for its children. Ignoring SIGCHLD has the
+   * kernel reap them once we are done with them, instead of leaving thousands of zombies. Each
+   * trial gets the old disposition back, see restore_sigchld().
+   */
+  scratch = (snapshot->regs.rsp - 4096) & ~(uint64_t) 15;
+  write_memory(pid, scratch, &ignore, sizeof(ignore));
+  inject_syscall(pid, SYS_rt_sigaction, SIGCHLD, scratch, scratch + sizeof(ignore), 8, NULL);
+
+  for (offset = 0; offset < sizeof(snapshot->sigchld); offset += 8) {
+    uint64_t value = peek(pid, scratch + sizeof(ignore) + offset);
+    memcpy((char *) &snapshot->sigchld + offset, &value, 8);
+  }
+
+  return 0;
+}
+
+static pid_t fork_snapshot(const struct snapshot *snapshot) {
+  pid_t child = -1;
+
+  if (inject_syscall(snapshot->pid, SYS_fork, 0, 0, 0, 0, &child) < 0) {
+    return -1;
+  }
+
+  /* The child inherits PTRACE_O_TRACEFORK, but whatever the trial forks is none of our business. */
+  ptrace(PTRACE_SETOPTIONS, child, NULL, (void *) (long) PTRACE_O_EXITKILL);
+
+  return child;
+}
+
+/*
+ * Give a freshly forked child the disposition of SIGCHLD that the target had, so that it can wait
+ * for children of its own.
+ */
+static void restore_sigchld(pid_t child, const struct snapshot *snapshot) {
+  struct user_regs_struct regs;
+  uint64_t scratch;
+
+  get_regs(child, &regs);
+
+  scratch = (regs.rsp - 4096) & ~(uint64_t) 15;
+  write_memory(child, scratch, &snapshot->sigchld, sizeof(snapshot->sigchld));
+  inject_syscall(child, SYS_rt_sigaction, SIGCHLD, scratch, 0, 8, NULL);
+}
+
+/*
+ * Point stdout of a freshly forked child at path.
+ */
+static void redirect_output(pid_t child, const char *path) {
+  struct user_regs_struct regs;
+  uint64_t scratch;
+  long fd;
+
+  get_regs(child, &regs);
+
+  /* Well below the red zone, the stack has already been touched that far down by the loader. */
+  scratch = (regs.rsp - 4096) & ~(uint64_t) 15;
+  write_memory(child, scratch, path, strlen(path) + 1);
+
+  fd = inject_syscall(child, SYS_open, scratch, O_WRONLY | O_CREAT | O_TRUNC, 0644, 0, NULL);
+  if (fd >= 0) {
+    inject_syscall(child, SYS_dup2, fd, STDOUT_FILENO, 0, 0, NULL);
+    inject_syscall(child, SYS_close, fd, 0, 0, 0, NULL);
+  }
+}
+
+static uint64_t hash_file(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+  FILE *file = fopen(path, "rb");
+  int c;
+
+  if (!file) {
+    return 0;
+  }
+
+  while ((c = fgetc(file)) != EOF) {
+    hash ^= (unsigned char) c;
+    hash *= 1099511628211ULL;
+  }
+
+  fclose(file);
+
+  return hash;
+}
+
+/*
+ * Trials
+ */
+
+static void on_alarm(int signal) {
+  (void) signal;
+  timed_out = 1;
+}
+
+static void arm_timer(long milliseconds) {
+  struct itimerval timer;
+
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_sec = milliseconds / 1000;
+  timer.it_value.tv_usec = milliseconds % 1000 * 1000;
+
+  timed_out = 0;
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static uint64_t random_code_address(const struct image *image, uint64_t base, uint64_t *rng) {
+  const struct function *target = &image->functions[next_random(rng) % image->num_functions];
+
+  return base + target->start + next_random(rng) % target->size;
+}
+
+static void flip_register(struct user_regs_struct *regs, uint64_t *rng) {
+  unsigned long long *registers[] = {
+    &regs->rax, &regs->rbx, &regs->rcx, &regs->rdx, &regs->rsi, &regs->rdi, &regs->rbp,
+    &regs->r8, &regs->r9, &regs->r10, &regs->r11, &regs->r12, &regs->r13, &regs->r14, &regs->r15
+  };
+  int index = next_random(rng) % (sizeof(registers) / sizeof(registers[0]));
+
+  *registers[index] ^= 1ULL << (next_random(rng) % 64);
+}
+
+static void inject_fault(pid_t child, enum fault fault, const struct image *image, uint64_t base,
+    struct user_regs_struct *regs, uint64_t *rng) {
+
+  switch (fault) {
+    case FAULT_BRANCH:
+      regs->rip = random_code_address(image, base, rng);
+      break;
+    case FAULT_RETURN:
+      /* We are at the entry of the function, so the return address is on top of the stack. */
+      poke(child, regs->rsp, random_code_address(image, base, rng));
+      break;
+    case FAULT_GSR: {
+      /* Variant II TLS: the block of the executable sits right below the thread pointer. */
+      uint64_t address = regs->fs_base - image->tls_block_size + image->gsr_offset;
+      uint64_t bit = next_random(rng) % (image->gsr_size * 8);
+      poke(child, address, peek(child, address) ^ (1ULL << bit));
+      break;
+    }
+    case FAULT_REGISTER:
+      flip_register(regs, rng);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Run a forked child to completion, with a fault injected unless fault is NUM_FAULTS. For the
+ * fault-free run, status and hash return what it did.
+ */
+static enum outcome run_trial(const struct snapshot *snapshot, const struct image *image,
+    enum fault fault, const char *output, uint64_t *rng, int *exit_status, uint64_t *hash) {
+
+  const struct function *function = &image->functions[next_random(rng) % image->num_functions];
+  uint64_t breakpoint = snapshot->base + function->start;
+  uint64_t hook = image->hook ? snapshot->base + image->hook : 0;
+  int hits = 1 + next_random(rng) % max_hits;
+  int activated = fault == NUM_FAULTS;
+  uint64_t word = 0;
+  int status, signal = 0;
+  enum outcome outcome;
+  pid_t child;
+
+  child = fork_snapshot(snapshot);
+  if (child < 0) {
+    return NOT_ACTIVATED;
+  }
+
+  restore_sigchld(child, snapshot);
+  redirect_output(child, output);
+
+  if (!activated) {
+    word = set_breakpoint(child, breakpoint);
+  }
+
+  /* The hook may well abort(), so we have to catch checks failing on the way in. */
+  if (hook) {
+    set_breakpoint(child, hook);
+  }
+
+  arm_timer(timeout_ms);
+
+  for (;;) {
+    struct user_regs_struct regs;
+
+    ptrace(PTRACE_CONT, child, NULL, (void *) (long) signal);
+    signal = 0;
+
+    if (wait_for(child, &status)) {
+      kill(child, SIGKILL);
+      waitpid(child, &status, __WALL);
+      outcome = HUNG;
+      break;
+    }
+
+    if (WIFEXITED(status)) {
+      if (!activated) {
+        outcome = NOT_ACTIVATED;
+      } else if (fault == NUM_FAULTS) {
+        *exit_status = WEXITSTATUS(status);
+        *hash = hash_file(output);
+        outcome = MASKED;
+      } else if (WEXITSTATUS(status) == *exit_status && hash_file(output) == *hash) {
+        outcome = MASKED;
+      } else {
+        outcome = CORRUPTED;
+      }
+      break;
+    }
+
+    if (WIFSIGNALED(status)) {
+      outcome = activated ? CRASHED : NOT_ACTIVATED;
+      break;
+    }
+
+    get_regs(child, &regs);
+
+    if (hook && WSTOPSIG(status) == SIGTRAP && regs.rip - 1 == hook) {
+      outcome = activated ? DETECTED : NOT_ACTIVATED;
+      kill(child, SIGKILL);
+      waitpid(child, &status, __WALL);
+      break;
+    }
+
+    if (!activated && WSTOPSIG(status) == SIGTRAP && regs.rip - 1 == breakpoint) {
+      poke(child, breakpoint, word);
+      regs.rip = breakpoint;
+
+      if (--hits) {
+        /* Step over the original instruction and put the breakpoint back. */
+        set_regs(child, &regs);
+        ptrace(PTRACE_SINGLESTEP, child, NULL, NULL);
+        wait_for(child, &status);
+        set_breakpoint(child, breakpoint);
+      } else {
+        inject_fault(child, fault, image, snapshot->base, &regs, rng);
+        set_regs(child, &regs);
+        activated = 1;
+      }
+
+      continue;
+    }
+
+    switch (WSTOPSIG(status)) {
+      case SIGILL:
+      case SIGSEGV:
+      case SIGBUS:
+      case SIGFPE:
+      case SIGTRAP:
+      case SIGABRT:
+        if (activated) {
+          uint64_t rip = regs.rip - snapshot->base;
+          int in_handler = rip >= image->handler_start && rip < image->handler_end;
+
+          outcome = WSTOPSIG(status) == SIGILL && in_handler ? DETECTED : CRASHED;
+          kill(child, SIGKILL);
+          waitpid(child, &status, __WALL);
+          goto done;
+        }
+        /* Fall through. */
+      default:
+        signal = WSTOPSIG(status);
+        break;
+    }
+  }
+
+done:
+  arm_timer(0);
+
+  return outcome;
+}
+
+/*
+ * One worker: a snapshot of its own and its share of the trials, with counts written to fd.
+ */
+static int run_worker(const struct image *image, enum fault fault, long trials, int worker,
+    int fd) {
+
+  struct snapshot snapshot;
+  struct counts counts;
+  char output[MAX_PATH];
+  const char *tmp = getenv("TMPDIR");
+  uint64_t rng = seed * 2654435761ULL + worker * 40503ULL + fault + 1;
+  uint64_t hash = 0;
+  int exit_status = 0;
+  double start, golden;
+  long i;
+
+  memset(&counts, 0, sizeof(counts));
+  snprintf(output, sizeof(output), "%s/cfcss-inject-%d.out", tmp ? tmp : "/tmp", getpid());
+
+  if (take_snapshot(image, &snapshot)) {
+    return 1;
+  }
+
+  /* The fault-free run tells us what to compare against, and how long to wait for a hang. */
+  start = now();
+  if (run_trial(&snapshot, image, NUM_FAULTS, output, &rng, &exit_status, &hash) != MASKED) {
+    fprintf(stderr, "%s: fault-free run did not complete.\n", image->path);
+    kill(snapshot.pid, SIGKILL);
+    return 1;
+  }
+  golden = now() - start;
+
+  if (!timeout_ms) {
+    timeout_ms = 50 + (long) (golden * 3000);
+  }
+
+  for (i = 0; i < trials; ++i) {
+    ++counts.outcomes[run_trial(&snapshot, image, fault, output, &rng, &exit_status, &hash)];
+  }
+
+  kill(snapshot.pid, SIGKILL);
+  waitpid(snapshot.pid, NULL, __WALL);
+  unlink(output);
+
+  if (write(fd, &counts, sizeof(counts)) != sizeof(counts)) {
+    return 1;
+  }
+
+  return 0;
+}
+
+static int run_campaign(const struct image *image, enum fault fault) {
+  struct counts total;
+  long detected, manifested;
+  double start = now();
+  int fds[2];
+  int worker, failed = 0;
+
+  if (fault == FAULT_GSR && !image->has_gsr) {
+    fprintf(stderr, "%s: no %s, skipping gsr faults.\n", image->path, GSR_PREFIX);
+    return 0;
+  }
+
+  if (pipe(fds)) {
+    perror("pipe");
+    return -1;
+  }
+
+  for (worker = 0; worker < num_jobs; ++worker) {
+    long trials = num_trials / num_jobs + (worker < num_trials % num_jobs);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      perror("fork");
+      return -1;
+    }
+
+    if (!pid) {
+      close(fds[0]);
+      _exit(run_worker(image, fault, trials, worker, fds[1]));
+    }
+  }
+
+  close(fds[1]);
+  memset(&total, 0, sizeof(total));
+
+  for (worker = 0; worker < num_jobs; ++worker) {
+    struct counts counts;
+    int i;
+
+    if (read(fds[0], &counts, sizeof(counts)) != sizeof(counts)) {
+      continue;
+    }
+
+    for (i = 0; i < NUM_OUTCOMES; ++i) {
+      total.outcomes[i] += counts.outcomes[i];
+    }
+  }
+
+  close(fds[0]);
+
+  for (worker = 0; worker < num_jobs; ++worker) {
+    int status;
+
+    wait(&status);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+  }
+
+  detected = total.outcomes[DETECTED];
+  manifested = detected + total.outcomes[CRASHED] + total.outcomes[HUNG]
+      + total.outcomes[CORRUPTED];
+
+  printf("%s,%s,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%.4f,%.0f\n", image->name, fault_names[fault],
+      num_trials, total.outcomes[NOT_ACTIVATED], total.outcomes[MASKED], detected,
+      total.outcomes[CRASHED], total.outcomes[HUNG], total.outcomes[CORRUPTED],
+      manifested ? (double) detected / manifested : 0.0, num_trials / (now() - start));
+  fflush(stdout);
+
+  return failed ? -1 : 0;
+}
+
+static void parse_faults(char *list) {
+  char *name;
+  int i;
+
+  for (i = 0; i < NUM_FAULTS; ++i) {
+    faults_enabled[i] = 0;
+  }
+
+  for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+    for (i = 0; i < NUM_FAULTS && strcmp(name, fault_names[i]); ++i);
+
+    if (i == NUM_FAULTS) {
+      fprintf(stderr, "Unknown fault model [%s].\n", name);
+      exit(2);
+    }
+
+    faults_enabled[i] = 1;
+  }
+}
+
+int main(int argc, char **argv) {
+  struct image images[MAX_BINARIES];
+  struct sigaction action;
+  int num_images = 0;
+  int result = 0;
+  int option;
+  int i, fault;
+
+  while ((option = getopt(argc, argv, "n:j:m:h:t:s:S:")) != -1) {
+    switch (option) {
+      case 'n': num_trials = atol(optarg); break;
+      case 'j': num_jobs = atoi(optarg); break;
+      case 'm': parse_faults(optarg); break;
+      case 'h': max_hits = atoi(optarg); break;
+      case 't': timeout_ms = atol(optarg); break;
+      case 's': snapshot_symbol = optarg; break;
+      case 'S': seed = strtoul(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind == argc || num_trials < 1 || max_hits < 1) {
+    usage(argv[0]);
+  }
+
+  if (num_jobs < 1) {
+    num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_jobs < 1) {
+      num_jobs = 1;
+    }
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_alarm;
+  sigaction(SIGALRM, &action, NULL);
+
+  for (i = optind; i < argc && num_images < MAX_BINARIES; ++i) {
+    struct image *image = &images[num_images];
+    char *separator = strchr(argv[i], '=');
+
+    memset(image, 0, sizeof(*image));
+
+    if (separator) {
+      *separator = '\0';
+      image->name = argv[i];
+      image->path = separator + 1;
+    } else {
+      image->name = image->path = argv[i];
+    }
+
+    if (load_image(image)) {
+      return 1;
+    }
+
+    ++num_images;
+  }
+
+  printf("binary,fault,trials,not_activated,masked,detected,crashed,hung,corrupted,coverage,"
+      "trials_per_second\n");
+
+  for (i = 0; i < num_images; ++i) {
+    for (fault = 0; fault < NUM_FAULTS; ++fault) {
+      if (faults_enabled[fault]) {
+        result |= run_campaign(&images[i], fault);
+      }
+    }
+  }
+
+  return result ? 1 : 0;
+}